@@ -0,0 +1,104 @@
+# SPDX-License-Identifier: GPL-2.0
+#
+# Schedule the test list on stdin using the run times recorded in check.time.
+#
+# Variables:
+#   timefile	check.time file with the test run times
+#   srcdir	prefix to strip from test names to get check.time names
+#   nshards	split the list into this many shards of about equal run time
+#   shard	which shard (1..nshards) to print
+#   budget	only print tests whose run times add up to less than this
+#   jobs	number of tests run at once, scales the budget
+#   failed	names of tests that failed last time, scheduled first in budget
+#		mode
+#   lpt		print the tests longest first instead of in input order
+#
+# Tests we have no time for are assumed to take the average time of the
+# rest.  Shard assignment only depends on the names and times of the tests,
+# not on the input order, so every shard of a split agrees on it.
+
+# sort idx[0..n-1] by decreasing estimated time, then by name
+function sort_longest(idx, n,	i, j, v) {
+	for (i = 1; i < n; i++) {
+		v = idx[i]
+		for (j = i - 1; j >= 0; j--) {
+			if (est[idx[j]] > est[v] ||
+			    (est[idx[j]] == est[v] && key[idx[j]] < key[v]))
+				break
+			idx[j + 1] = idx[j]
+		}
+		idx[j + 1] = v
+	}
+}
+
+BEGIN {
+	n = 0
+	while ((getline line < timefile) > 0) {
+		if (split(line, t) == 2)
+			secs[t[1]] = t[2]
+	}
+	nfailed = split(failed, f)
+	for (i = 1; i <= nfailed; i++)
+		isfailed[f[i]] = 1
+}
+
+$1 != "" {
+	name[n] = $1
+	key[n] = $1
+	sub("^" srcdir "/", "", key[n])
+	if (key[n] in secs) {
+		est[n] = secs[key[n]]
+		total += est[n]
+		known++
+	}
+	n++
+}
+
+END {
+	avg = known ? total / known : 1
+	for (i = 0; i < n; i++) {
+		if (!(key[i] in secs))
+			est[i] = avg
+		order[i] = i
+		keep[i] = 1
+	}
+	sort_longest(order, n)
+
+	# greedy longest processing time first: the next longest test goes
+	# to the shard with the least work so far
+	if (nshards > 1) {
+		for (s = 0; s < nshards; s++)
+			load[s] = 0
+		for (i = 0; i < n; i++) {
+			m = 0
+			for (s = 1; s < nshards; s++)
+				if (load[s] < load[m])
+					m = s
+			load[m] += est[order[i]]
+			keep[order[i]] = (m == shard - 1)
+		}
+	}
+
+	# fill the budget with the tests that failed last time, then with as
+	# many of the others as fit, shortest first
+	if (budget > 0) {
+		room = budget * (jobs > 1 ? jobs : 1)
+		for (pass = 0; pass < 2; pass++) {
+			for (i = n - 1; i >= 0; i--) {
+				j = order[i]
+				if (!keep[j] || (pass == 0) != (key[j] in isfailed))
+					continue
+				if (est[j] <= room)
+					room -= est[j]
+				else
+					keep[j] = 0
+			}
+		}
+	}
+
+	for (i = 0; i < n; i++) {
+		j = lpt ? order[i] : i
+		if (keep[j])
+			print name[j]
+	}
+}
@@ -0,0 +1,104 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Copy the data extents of a sparse file to the same offsets in another file
+ * or block device and leave the rest of the destination alone.  Unlike dd
+ * conv=sparse this never reads the holes, so the cost only depends on how
+ * much data there is.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/types.h>
+
+#ifndef SEEK_DATA
+#define SEEK_DATA	3
+#define SEEK_HOLE	4
+#endif
+
+#define BUF_SIZE	(1024 * 1024)
+
+static void
+usage(char *cmd)
+{
+	fprintf(stderr, "Usage: %s src dst\n", cmd);
+	exit(1);
+}
+
+static int
+copy_range(int sfd, int dfd, char *buf, off_t off, off_t end)
+{
+	ssize_t	ret;
+	size_t	len;
+
+	while (off < end) {
+		len = end - off < BUF_SIZE ? end - off : BUF_SIZE;
+		ret = pread(sfd, buf, len, off);
+		if (ret <= 0)
+			return -1;
+		len = ret;
+		ret = pwrite(dfd, buf, len, off);
+		if (ret < 0)
+			return -1;
+		off += ret;
+	}
+	return 0;
+}
+
+int
+main(int argc, char **argv)
+{
+	char	*buf;
+	off_t	data;
+	off_t	hole;
+	int	sfd;
+	int	dfd;
+
+	if (argc != 3)
+		usage(argv[0]);
+
+	sfd = open(argv[1], O_RDONLY);
+	if (sfd < 0) {
+		perror(argv[1]);
+		return 1;
+	}
+	dfd = open(argv[2], O_WRONLY);
+	if (dfd < 0) {
+		perror(argv[2]);
+		return 1;
+	}
+	buf = malloc(BUF_SIZE);
+	if (!buf) {
+		perror("malloc");
+		return 1;
+	}
+
+	for (hole = 0; ; ) {
+		data = lseek(sfd, hole, SEEK_DATA);
+		if (data < 0) {
+			if (errno == ENXIO)	/* no data past hole */
+				break;
+			perror("SEEK_DATA");
+			return 1;
+		}
+		hole = lseek(sfd, data, SEEK_HOLE);
+		if (hole < 0) {
+			perror("SEEK_HOLE");
+			return 1;
+		}
+		if (copy_range(sfd, dfd, buf, data, hole) < 0) {
+			perror("copy");
+			return 1;
+		}
+	}
+
+	if (fsync(dfd) < 0) {
+		perror("fsync");
+		return 1;
+	}
+	free(buf);
+	close(sfd);
+	close(dfd);
+	return 0;
+}
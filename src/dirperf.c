@@ -7,17 +7,28 @@
 #include <sys/param.h>
 #include <sys/stat.h>
 #include <sys/time.h>
+#include <sys/syscall.h>
 #include <dirent.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <math.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include "statx.h"
 
 typedef unsigned int uint_t;
 
+struct linux_dirent64 {
+	uint64_t	d_ino;
+	int64_t		d_off;
+	unsigned short	d_reclen;
+	unsigned char	d_type;
+	char		d_name[0];
+};
+
 /*
  * Loop over directory sizes:
  *	make m directories
@@ -28,8 +39,21 @@ typedef unsigned int uint_t;
  * Allow control of starting & stopping sizes, name length, target directory.
  * Print size and wallclock time (ms per file).
  * Output can be used to make graphs (gnuplot)
+ *
+ * Optionally, between the stat and readdir phases, run extra lookup passes
+ * (-p) and getdents64 buffer size sweeps (-b), each timed on its own and
+ * added as a column in usec per lookup or per entry.  These are not part of
+ * the ms per file figure.
  */
 
+enum pass { P_SEQ, P_RANDOM, P_REVERSE, P_ZIPF, P_NEGATIVE, P_STATX };
+
+static char	*passnames[] = {
+	"seq", "random", "reverse", "zipf", "negative", "statx", NULL
+};
+
+#define	MAX_COLUMNS	16
+
 static uint_t	addval;
 static uint_t	dirchars;
 static char	*directory;
@@ -41,8 +65,21 @@ static uint_t	nchars;
 static uint_t	ndirs;
 static uint_t	pfxchars;
 static uint_t	stats;
+static int	passes[MAX_COLUMNS];
+static int	npasses;
+static uint_t	bufsizes[MAX_COLUMNS];
+static int	nbufs;
+static double	zipfexp = 1.0;
+static uint_t	seed = 1;
+static uint_t	*order;
 
 static void	filename(int, int, char *);
+static void	negname(int, int, char *);
+static void	mkorder(int, uint_t);
+static double	lookuppass(int, uint_t, char *);
+static double	getdentspass(uint_t);
+static void	parsepasses(char *);
+static void	parsebufsizes(char *);
 static int	hexchars(uint_t);
 static uint_t	nextsize(uint_t);
 static double	now(void);
@@ -69,12 +106,17 @@ main(int argc, char **argv)
 	char		name[NAME_MAX + 1];
 	struct stat	stb;
 	double		stime;
+	double		ptime;
+	double		col[MAX_COLUMNS * 2];
 
-	while ((c = getopt(argc, argv, "a:c:d:f:l:m:n:s:")) != -1) {
+	while ((c = getopt(argc, argv, "a:b:c:d:f:l:m:n:p:r:s:z:")) != -1) {
 		switch (c) {
 		case 'a':
 			addval = (uint_t)atoi(optarg);
 			break;
+		case 'b':
+			parsebufsizes(optarg);
+			break;
 		case 'c':
 			nchars = (uint_t)atoi(optarg);
 			break;
@@ -93,9 +135,18 @@ main(int argc, char **argv)
 		case 'n':
 			ndirs = (uint_t)atoi(optarg);
 			break;
+		case 'p':
+			parsepasses(optarg);
+			break;
+		case 'r':
+			seed = (uint_t)atoi(optarg);
+			break;
 		case 's':
 			stats = (uint_t)atoi(optarg);
 			break;
+		case 'z':
+			zipfexp = atof(optarg);
+			break;
 		case '?':
 		default:
 			usage();
@@ -150,6 +201,19 @@ main(int argc, char **argv)
 		name[dirchars] = '\0';
 		mkdir(name, 0777);
 	}
+	if (npasses || nbufs) {
+		order = malloc(lastsize * sizeof(*order));
+		if (!order) {
+			perror("malloc");
+			exit(1);
+		}
+		printf("# size ms/file");
+		for (i = 0; i < npasses; i++)
+			printf(" %s", passnames[passes[i]]);
+		for (i = 0; i < nbufs; i++)
+			printf(" getdents%u", bufsizes[i]);
+		printf("\n");
+	}
 	for (cursize = firstsize;
 	     cursize <= lastsize;
 	     cursize = nextsize(cursize)) {
@@ -166,6 +230,12 @@ main(int argc, char **argv)
 				stat(name, &stb);
 			}
 		}
+		ptime = now();
+		for (i = 0; i < npasses; i++)
+			col[i] = lookuppass(passes[i], cursize, name);
+		for (i = 0; i < nbufs; i++)
+			col[npasses + i] = getdentspass(bufsizes[i]);
+		stime += now() - ptime;
 		for (j = 0; j < ndirs; j++) {
 			filename(0, j, name);
 			name[dirchars] = '\0';
@@ -180,8 +250,11 @@ main(int argc, char **argv)
 				unlink(name);
 			}
 		}
-		printf("%d %.3f\n", cursize,
+		printf("%d %.3f", cursize,
 			(now() - stime) * 1.0e3 / (cursize * ndirs));
+		for (i = 0; i < npasses + nbufs; i++)
+			printf(" %.3f", col[i]);
+		printf("\n");
 	}
 	for (j = 0; j < ndirs; j++) {
 		filename(0, j, name);
@@ -206,6 +279,198 @@ filename(int idx, int dir, char *name)
 	*name = '\0';
 }
 
+/*
+ * A name in the same directory that does not exist.  This overwrites the
+ * prefix, so name must not be the buffer the other passes use.
+ */
+static void
+negname(int idx, int dir, char *name)
+{
+	char	*p;
+
+	filename(idx, dir, name);
+	p = name + dirchars + 1;
+	if (pfxchars) {
+		*p = 'n';
+	} else {
+		memmove(p + 1, p, strlen(p) + 1);
+		*p = 'n';
+	}
+}
+
+static uint_t
+randidx(uint_t n)
+{
+	return (uint_t)(((double)random() / ((double)RAND_MAX + 1.0)) * n);
+}
+
+/*
+ * Lookup order for one round over cursize names.  Zipf picks names with a
+ * probability of 1/rank^zipfexp, with ranks assigned to names at random.
+ */
+static void
+mkorder(int pass, uint_t cursize)
+{
+	double	*cdf;
+	double	u;
+	uint_t	i;
+	uint_t	lo;
+	uint_t	hi;
+	uint_t	t;
+	uint_t	k;
+
+	srandom(seed);
+	for (i = 0; i < cursize; i++)
+		order[i] = pass == P_REVERSE ? cursize - 1 - i : i;
+	if (pass != P_RANDOM && pass != P_ZIPF)
+		return;
+	for (i = cursize - 1; i > 0; i--) {
+		k = randidx(i + 1);
+		t = order[i];
+		order[i] = order[k];
+		order[k] = t;
+	}
+	if (pass != P_ZIPF)
+		return;
+
+	cdf = malloc(cursize * sizeof(*cdf));
+	if (!cdf) {
+		perror("malloc");
+		exit(1);
+	}
+	for (i = 0; i < cursize; i++)
+		cdf[i] = (i ? cdf[i - 1] : 0) + 1.0 / pow(i + 1, zipfexp);
+	/* order[] holds the name for each rank, turn it into samples */
+	for (i = 0; i < cursize; i++) {
+		u = cdf[cursize - 1] * random() / ((double)RAND_MAX + 1.0);
+		for (lo = 0, hi = cursize - 1; lo < hi; ) {
+			k = (lo + hi) / 2;
+			if (cdf[k] <= u)
+				lo = k + 1;
+			else
+				hi = k;
+		}
+		cdf[i] = order[lo];
+	}
+	for (i = 0; i < cursize; i++)
+		order[i] = (uint_t)cdf[i];
+	free(cdf);
+}
+
+/* returns usec per lookup */
+static double
+lookuppass(int pass, uint_t cursize, char *name)
+{
+	struct stat	stb;
+	struct statx	stx;
+	char		nname[NAME_MAX + 2];
+	char		*lname = name;
+	double		stime;
+	uint_t		i;
+	uint_t		j;
+	uint_t		idx;
+	int		neg = pass == P_NEGATIVE;
+
+	mkorder(pass, cursize);
+	if (neg) {
+		/* negname() changes the prefix, keep it out of name */
+		lname = nname;
+		memset(&nname[dirchars + 1], 'a', pfxchars);
+	}
+	stime = now();
+	for (i = 0; i < cursize * stats; i++) {
+		for (j = 0; j < ndirs; j++) {
+			idx = order[(i + j) % cursize];
+			if (neg)
+				negname(idx, j, lname);
+			else
+				filename(idx, j, lname);
+			if (pass == P_STATX)
+				xfstests_statx(AT_FDCWD, lname,
+					AT_SYMLINK_NOFOLLOW | AT_STATX_DONT_SYNC,
+					STATX_TYPE, &stx);
+			else
+				stat(lname, &stb);
+		}
+	}
+	stime = now() - stime;
+	return stime * 1.0e6 / ((double)cursize * stats * ndirs);
+}
+
+/* read all directories with getdents64 into a buffer of bufsize bytes */
+static double
+getdentspass(uint_t bufsize)
+{
+	char	dname[NAME_MAX + 1];
+	char	*buf;
+	double	stime;
+	long	entries = 0;
+	long	ret;
+	long	off;
+	int	fd;
+	uint_t	j;
+
+	buf = malloc(bufsize);
+	if (!buf) {
+		perror("malloc");
+		exit(1);
+	}
+	stime = now();
+	for (j = 0; j < ndirs; j++) {
+		filename(0, j, dname);
+		dname[dirchars] = '\0';
+		fd = open(dname, O_RDONLY | O_DIRECTORY);
+		if (fd < 0) {
+			perror(dname);
+			exit(1);
+		}
+		while ((ret = syscall(SYS_getdents64, fd, buf, bufsize)) > 0) {
+			for (off = 0; off < ret; entries++)
+				off += ((struct linux_dirent64 *)(buf + off))->d_reclen;
+		}
+		if (ret < 0) {
+			perror("getdents64");
+			exit(1);
+		}
+		close(fd);
+	}
+	stime = now() - stime;
+	free(buf);
+	return entries ? stime * 1.0e6 / entries : 0;
+}
+
+static void
+parsepasses(char *list)
+{
+	char	*p;
+	int	i;
+
+	for (p = strtok(list, ","); p; p = strtok(NULL, ",")) {
+		for (i = 0; passnames[i]; i++)
+			if (strcmp(p, passnames[i]) == 0)
+				break;
+		if (!passnames[i] || npasses == MAX_COLUMNS) {
+			usage();
+			exit(1);
+		}
+		passes[npasses++] = i;
+	}
+}
+
+static void
+parsebufsizes(char *list)
+{
+	char	*p;
+
+	for (p = strtok(list, ","); p; p = strtok(NULL, ",")) {
+		if (nbufs == MAX_COLUMNS || atoi(p) <= 0) {
+			usage();
+			exit(1);
+		}
+		bufsizes[nbufs++] = (uint_t)atoi(p);
+	}
+}
+
 static int
 hexchars(uint_t maxval)
 {
@@ -258,5 +523,8 @@ usage(void)
 {
 	fprintf(stderr,
 		"usage: dirperf [-d dir] [-a addstep | -m mulstep] [-f first] "
-		"[-l last] [-c nchars] [-n ndirs] [-s nstats]\n");
+		"[-l last] [-c nchars] [-n ndirs] [-s nstats]\n"
+		"\t[-p pass,...] [-b bufsize,...] [-z zipfexp] [-r seed]\n"
+		"passes: seq random reverse zipf negative statx\n"
+		"-b reads all directories with getdents64 and each buffer size\n");
 }
@@ -25,14 +25,22 @@
 #include <sys/mkdev.h>
 #endif
 #include "md5.h"
+#include "xxhash.h"
 #include <netinet/in.h>
 #include <inttypes.h>
 #include <assert.h>
 #include <endian.h>
+#include <pthread.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
 
-#define CS_SIZE 16
+#define CS_MAX_SIZE 16
 #define CHUNKS	128
 
+#ifndef FS_IOC_GETVERSION
+#define FS_IOC_GETVERSION _IOR('v', 1, long)
+#endif
+
 #ifdef __linux__
 #ifndef SEEK_DATA
 #define SEEK_DATA 3
@@ -47,12 +55,80 @@ struct excludes {
 	int len;
 };
 
+enum _hash {
+	HASH_MD5,
+	HASH_XXH64,
+	NUM_HASHES
+};
+
+struct hash_algo {
+	const char	*name;
+	int		cs_size;
+};
+
+const struct hash_algo hash_algos[NUM_HASHES] = {
+	[HASH_MD5]	= { "md5", 16 },
+	[HASH_XXH64]	= { "xxh64", 8 },
+};
+
 typedef struct _sum {
-	MD5_CTX 	md5;
-	unsigned char	out[16];
+	union {
+		MD5_CTX 	md5;
+		XXH64_CTX	xxh64;
+	};
+	unsigned char	out[CS_MAX_SIZE];
+	int		final;
 } sum_t;
 
-typedef int (*sum_file_data_t)(int fd, sum_t *dst);
+/*
+ * A cached data sum.  The key is everything that changes when a file's
+ * contents are rewritten, the inode generation catches inode number reuse.
+ */
+struct cache_entry {
+	uint64_t	dev;
+	uint64_t	ino;
+	uint64_t	size;
+	uint64_t	mtime;
+	uint64_t	ctime;
+	uint64_t	gen;
+	unsigned char	cs[CS_MAX_SIZE];
+};
+
+struct {
+	char			*file;
+	int			verify;
+	/* open addressed hash of the entries loaded from file */
+	struct cache_entry	*old;
+	int			old_size;
+	/* entries for this run, written back on exit */
+	pthread_mutex_t		lock;
+	struct cache_entry	*new;
+	int			nr_new;
+	int			alloc_new;
+	int			hits;
+} cache = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+/*
+ * Sums over fixed size blocks of a file's data, the leaves of its hash tree.
+ * Blocks are hashed the same way as the whole file, so in strict mode a
+ * block's sum includes the offsets of its data and holes are told apart
+ * from zeroes.  Only one block sum is in progress at a time.
+ */
+struct block_sums {
+	uint64_t	size;
+	uint64_t	nr;
+	uint64_t	alloc;
+	unsigned char	*leaves;
+	sum_t		cur;
+	/* data extents [start, end) seen in strict mode */
+	uint64_t	*extents;
+	int		nr_extents;
+	int		alloc_extents;
+};
+
+typedef int (*sum_file_data_t)(int fd, sum_t *dst, struct block_sums *blocks);
 
 int gen_manifest = 0;
 int in_manifest = 0;
@@ -60,6 +136,11 @@ char *checksum = NULL;
 struct excludes *excludes;
 int n_excludes = 0;
 int verbose = 0;
+int nr_threads = 1;
+char *blocks_file = NULL;
+FILE *blocks_fp;
+uint64_t block_size = 1024 * 1024;
+enum _hash hash = HASH_MD5;
 FILE *out_fp;
 FILE *in_fp;
 
@@ -150,14 +231,23 @@ usage(void)
 	fprintf(stderr, "    -n           : reset all flags\n");
 	fprintf(stderr, "    -N           : set all flags\n");
 	fprintf(stderr, "    -x path      : exclude path when building checksum (multiple ok)\n");
+	fprintf(stderr, "    -j <threads> : walk the tree and hash files with this many threads\n");
+	fprintf(stderr, "    -H <hash>    : hash algorithm, md5 (default) or xxh64\n");
+	fprintf(stderr, "    -k <file>    : cache file data sums in file and reuse them for unchanged files\n");
+	fprintf(stderr, "    -K           : rehash all files even with -k, report stale cache entries\n");
+	fprintf(stderr, "    -b <file>    : with -f, write per block sums of all files to file. With -r,\n");
+	fprintf(stderr, "                   read them back to report which byte ranges differ\n");
+	fprintf(stderr, "    -B <size>    : block size for -b, default 1M\n");
+	fprintf(stderr, "    -I           : read file data with O_DIRECT\n");
 	fprintf(stderr, "    -h           : this help\n\n");
 	fprintf(stderr, "The default field mask is ugoamCdtES. If the checksum/manifest is read from a\n");
 	fprintf(stderr, "file, the mask is taken from there and the values given on the command line\n");
-	fprintf(stderr, "are ignored.\n");
+	fprintf(stderr, "are ignored. The same goes for the hash algorithm.\n");
 	exit(-1);
 }
 
-static char buf[65536];
+/* one per thread for the parallel walk */
+static __thread char buf[65536];
 
 void *
 alloc(size_t sz)
@@ -172,28 +262,77 @@ alloc(size_t sz)
 	return p;
 }
 
+void
+parse_hash(char *name)
+{
+	int i;
+
+	for (i = 0; i < NUM_HASHES; ++i) {
+		if (strcmp(hash_algos[i].name, name) == 0) {
+			hash = i;
+			return;
+		}
+	}
+	fprintf(stderr, "unrecognized hash algorithm %s\n", name);
+	exit(-1);
+}
+
+/*
+ * Split an optional ",<hash>" off a flag string read from a checksum or
+ * manifest, without one it was written with md5.
+ */
+void
+parse_flags_hash(char *p)
+{
+	char *h = strchr(p, ',');
+
+	hash = HASH_MD5;
+	if (h) {
+		*h++ = 0;
+		parse_hash(h);
+	}
+	parse_flags(p);
+}
+
 void
 sum_init(sum_t *cs)
 {
-	MD5_Init(&cs->md5);
+	cs->final = 0;
+	if (hash == HASH_XXH64)
+		XXH64_Init(&cs->xxh64, 0);
+	else
+		MD5_Init(&cs->md5);
 }
 
 void
 sum_fini(sum_t *cs)
 {
-	MD5_Final(cs->out, &cs->md5);
+	uint64_t v;
+
+	if (cs->final)
+		return;
+	cs->final = 1;
+	if (hash == HASH_XXH64) {
+		v = htobe64(XXH64_Final(&cs->xxh64));
+		memcpy(cs->out, &v, sizeof(v));
+	} else {
+		MD5_Final(cs->out, &cs->md5);
+	}
 }
 
 void
 sum_add(sum_t *cs, void *buf, int size)
 {
-	MD5_Update(&cs->md5, buf, size);
+	if (hash == HASH_XXH64)
+		XXH64_Update(&cs->xxh64, buf, size);
+	else
+		MD5_Update(&cs->md5, buf, size);
 }
 
 void
 sum_add_sum(sum_t *dst, sum_t *src)
 {
-	sum_add(dst, src->out, sizeof(src->out));
+	sum_add(dst, src->out, hash_algos[hash].cs_size);
 }
 
 void
@@ -213,9 +352,10 @@ char *
 sum_to_string(sum_t *dst)
 {
 	int i;
-	char *s = alloc(CS_SIZE * 2 + 1);
+	int cs_size = hash_algos[hash].cs_size;
+	char *s = alloc(cs_size * 2 + 1);
 
-	for (i = 0; i < CS_SIZE; ++i)
+	for (i = 0; i < cs_size; ++i)
 		sprintf(s + i * 2, "%02x", dst->out[i]);
 
 	return s;
@@ -321,48 +461,280 @@ out:
 	return ret;
 }
 
+struct block_sums *
+blocks_new(uint64_t size)
+{
+	struct block_sums *b = alloc(sizeof(*b));
+
+	memset(b, 0, sizeof(*b));
+	b->size = size;
+	sum_init(&b->cur);
+	return b;
+}
+
+void
+blocks_free(struct block_sums *b)
+{
+	if (!b)
+		return;
+	free(b->leaves);
+	free(b->extents);
+	free(b);
+}
+
+/* finish the block in progress and start the next one */
+void
+blocks_next(struct block_sums *b)
+{
+	int cs_size = hash_algos[hash].cs_size;
+
+	if (b->nr == b->alloc) {
+		b->alloc = b->alloc ? b->alloc * 2 : 16;
+		b->leaves = realloc(b->leaves, b->alloc * cs_size);
+		if (!b->leaves) {
+			fprintf(stderr, "malloc failed\n");
+			exit(-1);
+		}
+	}
+	sum_fini(&b->cur);
+	memcpy(b->leaves + b->nr * cs_size, b->cur.out, cs_size);
+	b->nr++;
+	sum_init(&b->cur);
+}
+
+void
+blocks_add(struct block_sums *b, uint64_t pos, char *data, int len)
+{
+	uint64_t *ext;
+	int n;
+
+	if (flags[FLAG_STRUCTURE]) {
+		ext = b->extents + 2 * (b->nr_extents - 1);
+		if (b->nr_extents && ext[1] == pos) {
+			ext[1] += len;
+		} else {
+			if (b->nr_extents == b->alloc_extents) {
+				b->alloc_extents += CHUNKS;
+				b->extents = realloc(b->extents,
+					2 * b->alloc_extents * sizeof(uint64_t));
+				if (!b->extents) {
+					fprintf(stderr, "malloc failed\n");
+					exit(-1);
+				}
+			}
+			ext = b->extents + 2 * b->nr_extents++;
+			ext[0] = pos;
+			ext[1] = pos + len;
+		}
+	}
+
+	while (len) {
+		while (b->nr < pos / block_size)
+			blocks_next(b);
+		n = block_size - pos % block_size;
+		if (n > len)
+			n = len;
+		if (flags[FLAG_STRUCTURE])
+			sum_add_u64(&b->cur, pos);
+		sum_add(&b->cur, data, n);
+		pos += n;
+		data += n;
+		len -= n;
+	}
+}
+
+void
+blocks_fini(struct block_sums *b)
+{
+	while (b->nr * block_size < b->size)
+		blocks_next(b);
+}
+
+/*
+ * File data is read in windows of READ_SIZE, with the next window handed to
+ * readahead while the current one is hashed.  In strict mode the sum covers
+ * 64k chunks each prefixed with its offset, where a chunk starts at the next
+ * data offset after the previous one, so those chunks are cut out of the
+ * windows.  Data extents are looked up once with SEEK_DATA/SEEK_HOLE, holes
+ * are never read.
+ */
+#define CHUNK_SIZE	65536
+#define READ_SIZE	(4 * 1024 * 1024)
+#define DIRECT_ALIGN	4096
+
+int direct_io = 0;
+static __thread char *rbuf;
+/* O_DIRECT on the file being read */
+static __thread int rdirect;
+
+struct extent_map {
+	uint64_t	*ext;	/* [start, end) pairs */
+	int		nr;
+	int		alloc;
+	int		cur;
+};
+
+/* SEEK_DATA on the map, -1 if there is no more data */
+int64_t
+extent_map_data(struct extent_map *m, uint64_t pos)
+{
+	for (; m->cur < m->nr; m->cur++) {
+		if (pos < m->ext[2 * m->cur + 1])
+			return pos > m->ext[2 * m->cur] ? pos :
+						m->ext[2 * m->cur];
+	}
+	return -1;
+}
+
 int
-sum_file_data_permissive(int fd, sum_t *dst)
+extent_map_build(int fd, struct extent_map *m)
 {
-	int ret;
+	off_t start;
+	off_t end = 0;
 
+	memset(m, 0, sizeof(*m));
 	while (1) {
-		ret = read(fd, buf, sizeof(buf));
+		start = lseek(fd, end, SEEK_DATA);
+		if (start == (off_t)-1)
+			return errno == ENXIO ? 0 : -2;
+		end = lseek(fd, start, SEEK_HOLE);
+		if (end == (off_t)-1)
+			return -2;
+		if (m->nr == m->alloc) {
+			m->alloc += CHUNKS;
+			m->ext = realloc(m->ext, 2 * m->alloc * sizeof(*m->ext));
+			if (!m->ext) {
+				fprintf(stderr, "malloc failed\n");
+				exit(-1);
+			}
+		}
+		m->ext[2 * m->nr] = start;
+		m->ext[2 * m->nr + 1] = end;
+		m->nr++;
+	}
+}
+
+/*
+ * Read len bytes at pos into rbuf, returns the number of bytes read which is
+ * only short at eof.  Falls back to buffered reads when O_DIRECT is refused.
+ */
+ssize_t
+read_window(int fd, uint64_t pos, size_t len)
+{
+	size_t done = 0;
+	size_t rlen;
+	ssize_t ret;
+
+	if (!rbuf && posix_memalign((void **)&rbuf, DIRECT_ALIGN, READ_SIZE)) {
+		fprintf(stderr, "malloc failed\n");
+		exit(-1);
+	}
+	if (!rdirect)
+		posix_fadvise(fd, pos + len, READ_SIZE, POSIX_FADV_WILLNEED);
+	while (done < len) {
+		rlen = len - done;
+		if (rdirect)
+			rlen = (rlen + DIRECT_ALIGN - 1) & ~(DIRECT_ALIGN - 1);
+		ret = pread(fd, rbuf + done, rlen, pos + done);
+		if (ret < 0 && errno == EINVAL && rdirect) {
+			fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_DIRECT);
+			rdirect = 0;
+			continue;
+		}
 		if (ret < 0)
 			return -errno;
-		sum_add(dst, buf, ret);
-		if (ret < sizeof(buf))
+		if (ret == 0)
 			break;
+		done += ret;
 	}
-	return 0;
+	return done < len ? done : len;
 }
 
-int
-sum_file_data_strict(int fd, sum_t *dst)
+void
+read_setup(int fd)
 {
-	int ret;
-	off_t pos;
+	rdirect = direct_io &&
+		  !fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_DIRECT);
+	if (!rdirect)
+		posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+}
 
-	pos = lseek(fd, 0, SEEK_CUR);
-	if (pos == (off_t)-1)
-		return errno == ENXIO ? 0 : -2;
+int
+sum_file_data_permissive(int fd, sum_t *dst, struct block_sums *blocks)
+{
+	uint64_t pos = 0;
+	ssize_t ret;
 
+	read_setup(fd);
 	while (1) {
-		pos = lseek(fd, pos, SEEK_DATA);
-		if (pos == (off_t)-1)
-			return errno == ENXIO ? 0 : -2;
-		ret = read(fd, buf, sizeof(buf));
-		assert(ret); /* eof found by lseek */
-		if (ret <= 0)
+		ret = read_window(fd, pos, READ_SIZE);
+		if (ret < 0)
 			return ret;
-		if (verbose >= 2)
-			fprintf(stderr,
-				"adding to sum at file offset %llu, %d bytes\n",
-				(unsigned long long)pos, ret);
-		sum_add_u64(dst, (uint64_t)pos);
-		sum_add(dst, buf, ret);
+		sum_add(dst, rbuf, ret);
+		if (blocks)
+			blocks_add(blocks, pos, rbuf, ret);
 		pos += ret;
+		if (ret < READ_SIZE)
+			break;
+	}
+	return 0;
+}
+
+int
+sum_file_data_strict(int fd, sum_t *dst, struct block_sums *blocks)
+{
+	struct extent_map map;
+	uint64_t win_start;
+	uint64_t win_end;
+	uint64_t eof = 0;
+	int64_t pos;
+	int64_t next;
+	ssize_t ret;
+	int len;
+
+	ret = extent_map_build(fd, &map);
+	if (ret < 0)
+		goto out;
+	read_setup(fd);
+
+	pos = extent_map_data(&map, 0);
+	while (pos >= 0 && (!eof || pos < eof)) {
+		/* chunks are contiguous as long as each starts in data */
+		win_start = pos;
+		win_end = pos;
+		next = pos;
+		while (next == win_end && win_end - win_start < READ_SIZE) {
+			win_end += CHUNK_SIZE;
+			next = extent_map_data(&map, win_end);
+		}
+		ret = read_window(fd, win_start, win_end - win_start);
+		if (ret < 0)
+			goto out;
+		if (ret < win_end - win_start)
+			eof = win_start + ret;
+
+		for (; pos < win_end; pos += CHUNK_SIZE) {
+			if (eof && pos >= eof)
+				break;
+			len = CHUNK_SIZE;
+			if (eof && pos + len > eof)
+				len = eof - pos;
+			if (verbose >= 2)
+				fprintf(stderr,
+					"adding to sum at file offset %llu, %d bytes\n",
+					(unsigned long long)pos, len);
+			sum_add_u64(dst, (uint64_t)pos);
+			sum_add(dst, rbuf + (pos - win_start), len);
+			if (blocks)
+				blocks_add(blocks, pos, rbuf + (pos - win_start),
+					   len);
+		}
+		pos = next;
 	}
+	ret = 0;
+out:
+	free(map.ext);
+	return ret;
 }
 
 char *
@@ -415,9 +787,276 @@ pathcmp(const char *a, const char *b)
 	return strcmp(a, b);
 }
 
+/*
+ * The block sums file starts with a header giving the hash and block size,
+ * followed by one record per file in manifest order:
+ *
+ *	u32 name length, escaped name as in the manifest, u64 file size,
+ *	u64 number of blocks, block sums
+ *
+ * All integers are little endian.
+ */
+#define BLOCKS_MAGIC	0x6b6c626d75737366ULL	/* "fssumblk" */
+#define BLOCKS_VERSION	1
+
+struct blocks_header {
+	uint64_t	magic;
+	uint32_t	version;
+	uint32_t	hash;
+	uint64_t	block_size;
+};
+
+void
+blocks_write_header(void)
+{
+	struct blocks_header h;
+
+	h.magic = htole64(BLOCKS_MAGIC);
+	h.version = htole32(BLOCKS_VERSION);
+	h.hash = htole32(hash);
+	h.block_size = htole64(block_size);
+	if (fwrite(&h, sizeof(h), 1, blocks_fp) != 1) {
+		perror("write block sums");
+		exit(-1);
+	}
+}
+
+void
+blocks_read_header(void)
+{
+	struct blocks_header h;
+
+	if (fread(&h, sizeof(h), 1, blocks_fp) != 1 ||
+	    le64toh(h.magic) != BLOCKS_MAGIC ||
+	    le32toh(h.version) != BLOCKS_VERSION) {
+		fprintf(stderr, "invalid block sums file %s\n", blocks_file);
+		exit(-1);
+	}
+	if (le32toh(h.hash) != hash) {
+		fprintf(stderr, "block sums in %s use a different hash\n",
+			blocks_file);
+		exit(-1);
+	}
+	block_size = le64toh(h.block_size);
+}
+
+void
+blocks_write(char *fn, struct block_sums *b)
+{
+	uint32_t len = htole32(strlen(fn));
+	uint64_t size = htole64(b->size);
+	uint64_t nr = htole64(b->nr);
+
+	if (fwrite(&len, sizeof(len), 1, blocks_fp) != 1 ||
+	    fwrite(fn, strlen(fn), 1, blocks_fp) != 1 ||
+	    fwrite(&size, sizeof(size), 1, blocks_fp) != 1 ||
+	    fwrite(&nr, sizeof(nr), 1, blocks_fp) != 1 ||
+	    (b->nr && fwrite(b->leaves, hash_algos[hash].cs_size * b->nr, 1,
+			     blocks_fp) != 1)) {
+		perror("write block sums");
+		exit(-1);
+	}
+}
+
+/* the next remote record, we walk the file in step with the manifest */
+char *rem_blocks_fn;
+struct block_sums rem_blocks;
+
+int
+blocks_read_next(void)
+{
+	uint32_t len;
+	uint64_t v;
+	int cs_size = hash_algos[hash].cs_size;
+
+	free(rem_blocks_fn);
+	rem_blocks_fn = NULL;
+	if (fread(&len, sizeof(len), 1, blocks_fp) != 1)
+		return 0;
+	len = le32toh(len);
+	rem_blocks_fn = alloc(len + 1);
+	if (fread(rem_blocks_fn, len, 1, blocks_fp) != 1)
+		goto truncated;
+	rem_blocks_fn[len] = 0;
+	if (fread(&v, sizeof(v), 1, blocks_fp) != 1)
+		goto truncated;
+	rem_blocks.size = le64toh(v);
+	if (fread(&v, sizeof(v), 1, blocks_fp) != 1)
+		goto truncated;
+	rem_blocks.nr = le64toh(v);
+	if (rem_blocks.nr > rem_blocks.alloc) {
+		rem_blocks.alloc = rem_blocks.nr;
+		free(rem_blocks.leaves);
+		rem_blocks.leaves = alloc(rem_blocks.nr * cs_size);
+	}
+	if (rem_blocks.nr &&
+	    fread(rem_blocks.leaves, rem_blocks.nr * cs_size, 1,
+		  blocks_fp) != 1)
+		goto truncated;
+	return 1;
+truncated:
+	fprintf(stderr, "truncated block sums file %s\n", blocks_file);
+	exit(-1);
+}
+
+struct block_sums *
+blocks_find(char *fn)
+{
+	int cmp;
+
+	while (rem_blocks_fn) {
+		cmp = pathcmp(rem_blocks_fn, fn);
+		if (cmp == 0)
+			return &rem_blocks;
+		if (cmp > 0)
+			return NULL;
+		blocks_read_next();
+	}
+	return NULL;
+}
+
+/*
+ * Build the levels of a hash tree over n leaves.  Leaves missing on one side
+ * are filled with 0xff so that they differ from any real sum.
+ */
+unsigned char **
+blocks_tree(struct block_sums *b, uint64_t n, int *nr_levels, uint64_t **lens)
+{
+	int cs_size = hash_algos[hash].cs_size;
+	unsigned char **levels;
+	uint64_t len = n;
+	uint64_t i;
+	sum_t cs;
+	int l;
+
+	*nr_levels = 1;
+	while (len > 1) {
+		len = (len + 1) / 2;
+		(*nr_levels)++;
+	}
+	levels = alloc(*nr_levels * sizeof(*levels));
+	*lens = alloc(*nr_levels * sizeof(**lens));
+	levels[0] = alloc(n * cs_size);
+	memset(levels[0], 0xff, n * cs_size);
+	memcpy(levels[0], b->leaves, b->nr * cs_size);
+
+	len = n;
+	(*lens)[0] = n;
+	for (l = 1; l < *nr_levels; l++) {
+		(*lens)[l] = (len + 1) / 2;
+		levels[l] = alloc((len + 1) / 2 * cs_size);
+		for (i = 0; i < len; i += 2) {
+			sum_init(&cs);
+			sum_add(&cs, levels[l - 1] + i * cs_size,
+				(i + 1 < len ? 2 : 1) * cs_size);
+			sum_fini(&cs);
+			memcpy(levels[l] + i / 2 * cs_size, cs.out, cs_size);
+		}
+		len = (len + 1) / 2;
+	}
+	return levels;
+}
+
+struct blocks_diff {
+	struct block_sums *local;
+	unsigned char **a;
+	unsigned char **b;
+	uint64_t *lens;
+	uint64_t size;
+	/* pending range of differing blocks [start, end) */
+	uint64_t start;
+	uint64_t end;
+};
+
+void
+blocks_report(struct blocks_diff *d)
+{
+	uint64_t start = d->start * block_size;
+	uint64_t end = d->end * block_size;
+	uint64_t *ext;
+	int sep = 0;
+	int i;
+
+	if (d->start == d->end)
+		return;
+	if (end > d->size)
+		end = d->size;
+	printf("\tbytes %llu-%llu differ", (unsigned long long)start,
+	       (unsigned long long)end - 1);
+	for (i = 0; i < d->local->nr_extents; i++) {
+		ext = d->local->extents + 2 * i;
+		if (ext[1] <= start || ext[0] >= end)
+			continue;
+		printf("%s%llu-%llu", sep++ ? ", " : ", local extents ",
+		       (unsigned long long)ext[0],
+		       (unsigned long long)ext[1] - 1);
+	}
+	printf("\n");
+}
+
+/* in order descent into the subtrees that differ */
+void
+blocks_descend(struct blocks_diff *d, int level, uint64_t i)
+{
+	int cs_size = hash_algos[hash].cs_size;
+
+	if (i >= d->lens[level])
+		return;
+	if (!memcmp(d->a[level] + i * cs_size, d->b[level] + i * cs_size,
+		    cs_size))
+		return;
+	if (level) {
+		blocks_descend(d, level - 1, 2 * i);
+		blocks_descend(d, level - 1, 2 * i + 1);
+		return;
+	}
+	if (d->end != i) {
+		blocks_report(d);
+		d->start = i;
+	}
+	d->end = i + 1;
+}
+
+void
+blocks_compare(char *fn, struct block_sums *local)
+{
+	struct block_sums *remote = blocks_find(fn);
+	struct blocks_diff d;
+	uint64_t *lens;
+	uint64_t n;
+	int nr_levels;
+	int l;
+
+	if (!remote || !local)
+		return;
+	if (local->size != remote->size)
+		printf("\tsize %llu, expected %llu\n",
+		       (unsigned long long)local->size,
+		       (unsigned long long)remote->size);
+
+	memset(&d, 0, sizeof(d));
+	d.local = local;
+	d.size = local->size > remote->size ? local->size : remote->size;
+	n = local->nr > remote->nr ? local->nr : remote->nr;
+	if (!n)
+		return;
+	d.a = blocks_tree(local, n, &nr_levels, &d.lens);
+	d.b = blocks_tree(remote, n, &nr_levels, &lens);
+	free(lens);
+	blocks_descend(&d, nr_levels - 1, 0);
+	blocks_report(&d);
+	for (l = 0; l < nr_levels; l++) {
+		free(d.a[l]);
+		free(d.b[l]);
+	}
+	free(d.a);
+	free(d.b);
+	free(d.lens);
+}
+
 void
 check_match(char *fn, char *local_m, char *remote_m,
-	    char *local_c, char *remote_c)
+	    char *local_c, char *remote_c, struct block_sums *blocks)
 {
 	int match_m = !strcmp(local_m, remote_m);
 	int match_c = !strcmp(local_c, remote_c);
@@ -429,13 +1068,16 @@ check_match(char *fn, char *local_m, char *remote_m,
 	} else if (!match_m && !match_c) {
 		printf("metadata and data mismatch in %s\n", fn);
 	}
+	if (!match_c && blocks_fp)
+		blocks_compare(fn, blocks);
 }
 
 char *prev_fn;
 char *prev_m;
 char *prev_c;
 void
-check_manifest(char *fn, char *m, char *c, int last_call)
+check_manifest(char *fn, char *m, char *c, struct block_sums *blocks,
+	       int last_call)
 {
 	char *rem_m;
 	char *rem_c;
@@ -453,7 +1095,7 @@ check_manifest(char *fn, char *m, char *c, int last_call)
 		} else if (cmp < 0) {
 			missing_file(prev_fn);
 		} else {
-			check_match(fn, m, prev_m, c, prev_c);
+			check_match(fn, m, prev_m, c, prev_c, blocks);
 		}
 		free(prev_fn);
 		free(prev_m);
@@ -487,7 +1129,7 @@ malformed:
 		else
 			cmp = pathcmp(l, fn);
 		if (cmp == 0) {
-			check_match(fn, m, rem_m, c, rem_c);
+			check_match(fn, m, rem_m, c, rem_c, blocks);
 			return;
 		} else if (cmp > 0) {
 			excess_file(fn);
@@ -503,73 +1145,638 @@ malformed:
 }
 
 void
-sum(int dirfd, int level, sum_t *dircs, char *path_prefix, char *path_in)
+sum_add_stat(sum_t *meta, int level, char *name, struct stat64 *st)
+{
+	sum_add_u64(meta, level);
+	sum_add(meta, name, strlen(name));
+	if (!S_ISDIR(st->st_mode))
+		sum_add_u64(meta, st->st_nlink);
+	if (flags[FLAG_UID])
+		sum_add_u64(meta, st->st_uid);
+	if (flags[FLAG_GID])
+		sum_add_u64(meta, st->st_gid);
+	if (flags[FLAG_MODE])
+		sum_add_u64(meta, st->st_mode);
+	if (flags[FLAG_ATIME])
+		sum_add_time(meta, st->st_atime);
+	if (flags[FLAG_MTIME])
+		sum_add_time(meta, st->st_mtime);
+	if (flags[FLAG_CTIME])
+		sum_add_time(meta, st->st_ctime);
+}
+
+void
+sum_open_xattrs(int dirfd, char *name, sum_t *meta, char *path_prefix,
+		char *path)
 {
-	DIR *d;
-	struct dirent *de;
-	char **namelist = NULL;
-	int alloclen = 0;
-	int entries = 0;
-	int i;
-	int ret;
 	int fd;
-	int excl;
-	sum_file_data_t sum_file_data = flags[FLAG_STRUCTURE] ?
-			sum_file_data_strict : sum_file_data_permissive;
-	struct stat64 dir_st;
+	int ret;
 
-	if (fstat64(dirfd, &dir_st)) {
-		perror("fstat");
+	fd = openat(dirfd, name, 0);
+	if (fd == -1 && flags[FLAG_OPEN_ERROR]) {
+		sum_add_u64(meta, errno);
+	} else if (fd == -1) {
+		fprintf(stderr, "open failed for %s/%s: %s\n",
+			path_prefix, path, strerror(errno));
 		exit(-1);
+	} else {
+		ret = sum_xattrs(fd, meta);
+		close(fd);
+		if (ret < 0) {
+			fprintf(stderr, "failed to read xattrs from %s/%s: %s\n",
+				path_prefix, path, strerror(-ret));
+			exit(-1);
+		}
 	}
+}
 
-	d = fdopendir(dirfd);
-	if (!d) {
-		perror("opendir");
-		exit(-1);
+uint64_t
+cache_hash(struct cache_entry *e)
+{
+	return (e->ino ^ (e->dev << 32)) * 0x9E3779B97F4A7C15ULL;
+}
+
+void
+cache_insert_old(struct cache_entry *e)
+{
+	int i = cache_hash(e) % cache.old_size;
+
+	while (cache.old[i].ino || cache.old[i].dev)
+		i = (i + 1) % cache.old_size;
+	cache.old[i] = *e;
+}
+
+struct cache_entry *
+cache_lookup(struct cache_entry *key)
+{
+	struct cache_entry *e;
+	int i;
+
+	if (!cache.old_size)
+		return NULL;
+	for (i = cache_hash(key) % cache.old_size; ;
+	     i = (i + 1) % cache.old_size) {
+		e = &cache.old[i];
+		if (!e->ino && !e->dev)
+			return NULL;
+		if (e->dev == key->dev && e->ino == key->ino)
+			break;
 	}
-	while((de = readdir(d))) {
-		if (!strcmp(de->d_name, ".") || !strcmp(de->d_name, ".."))
-			continue;
-		if (entries == alloclen) {
-			alloclen += CHUNKS;
-			namelist = realloc(namelist,
-					   alloclen * sizeof(*namelist));
-			if (!namelist) {
-				fprintf(stderr, "malloc failed\n");
-				exit(-1);
-			}
-		}
-		namelist[entries] = strdup(de->d_name);
-		if (!namelist[entries]) {
+	if (e->size != key->size || e->mtime != key->mtime ||
+	    e->ctime != key->ctime || e->gen != key->gen)
+		return NULL;
+	return e;
+}
+
+void
+cache_add(struct cache_entry *e)
+{
+	pthread_mutex_lock(&cache.lock);
+	if (cache.nr_new == cache.alloc_new) {
+		cache.alloc_new += CHUNKS;
+		cache.new = realloc(cache.new,
+				    cache.alloc_new * sizeof(*cache.new));
+		if (!cache.new) {
 			fprintf(stderr, "malloc failed\n");
 			exit(-1);
 		}
-		++entries;
 	}
-	qsort(namelist, entries, sizeof(*namelist), namecmp);
-	for (i = 0; i < entries; ++i) {
-		struct stat64 st;
-		sum_t cs;
-		sum_t meta;
-		char *path;
+	cache.new[cache.nr_new++] = *e;
+	pthread_mutex_unlock(&cache.lock);
+}
 
-		sum_init(&cs);
-		sum_init(&meta);
-		path = alloc(strlen(path_in) + strlen(namelist[i]) + 3);
-		sprintf(path, "%s/%s", path_in, namelist[i]);
-		for (excl = 0; excl < n_excludes; ++excl) {
-			if (strncmp(excludes[excl].path, path,
-			    excludes[excl].len) == 0)
-				goto next;
-		}
+void
+cache_key_init(struct cache_entry *e, struct stat64 *st)
+{
+	memset(e, 0, sizeof(*e));
+	e->dev = st->st_dev;
+	e->ino = st->st_ino;
+	e->size = st->st_size;
+	e->mtime = st->st_mtim.tv_sec * 1000000000ULL + st->st_mtim.tv_nsec;
+	e->ctime = st->st_ctim.tv_sec * 1000000000ULL + st->st_ctim.tv_nsec;
+}
 
-		ret = fchdir(dirfd);
-		if (ret == -1) {
-			perror("fchdir");
-			exit(-1);
-		}
-		ret = lstat64(namelist[i], &st);
+/*
+ * The cache file starts with a line naming the hash and whether holes were
+ * included, a cache for any other combination is ignored.  Each further line
+ * is one entry: dev ino size mtime ctime generation sum.
+ */
+void
+cache_header(char *hdr, int len)
+{
+	snprintf(hdr, len, "fssum cache v1 %s %d", hash_algos[hash].name,
+		 flags[FLAG_STRUCTURE]);
+}
+
+void
+cache_load(void)
+{
+	struct cache_entry e;
+	unsigned long long v[6];
+	char hdr[64];
+	char cs[CS_MAX_SIZE * 2 + 1];
+	char *l;
+	int cs_size = hash_algos[hash].cs_size;
+	int nr = 0;
+	int i;
+	FILE *fp;
+
+	fp = fopen(cache.file, "r");
+	if (!fp) {
+		if (errno != ENOENT) {
+			fprintf(stderr, "failed to open cache %s: %s\n",
+				cache.file, strerror(errno));
+			exit(-1);
+		}
+		return;
+	}
+	cache_header(hdr, sizeof(hdr));
+	l = getln(line, sizeof(line), fp);
+	if (!l || strcmp(l, hdr)) {
+		if (verbose)
+			fprintf(stderr, "ignoring cache %s\n", cache.file);
+		goto out;
+	}
+	while (getln(line, sizeof(line), fp))
+		nr++;
+	cache.old_size = nr * 2 + 1;
+	cache.old = alloc(cache.old_size * sizeof(*cache.old));
+	memset(cache.old, 0, cache.old_size * sizeof(*cache.old));
+
+	rewind(fp);
+	getln(line, sizeof(line), fp);
+	while ((l = getln(line, sizeof(line), fp))) {
+		if (sscanf(l, "%llx %llx %llx %llx %llx %llx %32s", &v[0],
+			   &v[1], &v[2], &v[3], &v[4], &v[5], cs) != 7 ||
+		    strlen(cs) != cs_size * 2) {
+			fprintf(stderr, "invalid cache entry: %s\n", l);
+			exit(-1);
+		}
+		e.dev = v[0];
+		e.ino = v[1];
+		e.size = v[2];
+		e.mtime = v[3];
+		e.ctime = v[4];
+		e.gen = v[5];
+		for (i = 0; i < cs_size; i++)
+			sscanf(cs + i * 2, "%2hhx", &e.cs[i]);
+		cache_insert_old(&e);
+	}
+out:
+	fclose(fp);
+}
+
+void
+cache_save(void)
+{
+	struct cache_entry *e;
+	char hdr[64];
+	char *tmp;
+	int cs_size = hash_algos[hash].cs_size;
+	int i;
+	int j;
+	FILE *fp;
+
+	tmp = alloc(strlen(cache.file) + 5);
+	sprintf(tmp, "%s.tmp", cache.file);
+	fp = fopen(tmp, "w");
+	if (!fp) {
+		fprintf(stderr, "failed to write cache %s: %s\n", tmp,
+			strerror(errno));
+		exit(-1);
+	}
+	cache_header(hdr, sizeof(hdr));
+	fprintf(fp, "%s\n", hdr);
+	for (i = 0; i < cache.nr_new; i++) {
+		e = &cache.new[i];
+		fprintf(fp, "%llx %llx %llx %llx %llx %llx ",
+			(unsigned long long)e->dev, (unsigned long long)e->ino,
+			(unsigned long long)e->size,
+			(unsigned long long)e->mtime,
+			(unsigned long long)e->ctime,
+			(unsigned long long)e->gen);
+		for (j = 0; j < cs_size; j++)
+			fprintf(fp, "%02x", e->cs[j]);
+		fprintf(fp, "\n");
+	}
+	if (fclose(fp) || rename(tmp, cache.file)) {
+		fprintf(stderr, "failed to write cache %s: %s\n", cache.file,
+			strerror(errno));
+		exit(-1);
+	}
+	if (verbose)
+		fprintf(stderr, "cache: %d of %d files unchanged\n",
+			cache.hits, cache.nr_new);
+	free(tmp);
+}
+
+/*
+ * Open the data of a regular file and add it to cs, or the open error to
+ * meta if we are asked to include those.  With a cache, cs is finalized
+ * here, either from the cache or after hashing the file.  With -b the block
+ * sums are returned in blocksp.
+ */
+void
+sum_open_data(int dirfd, char *name, struct cache_entry *key, sum_t *meta,
+	      sum_t *cs, struct block_sums **blocksp, char *path_prefix,
+	      char *path)
+{
+	struct block_sums *blocks = NULL;
+	sum_file_data_t sum_file_data = flags[FLAG_STRUCTURE] ?
+			sum_file_data_strict : sum_file_data_permissive;
+	struct cache_entry *cached = NULL;
+	int cs_size = hash_algos[hash].cs_size;
+	long gen = 0;
+	int fd;
+	int ret;
+
+	if (verbose)
+		fprintf(stderr, "file %s\n", name);
+	fd = openat(dirfd, name, 0);
+	if (fd == -1 && flags[FLAG_OPEN_ERROR]) {
+		sum_add_u64(meta, errno);
+	} else if (fd == -1) {
+		fprintf(stderr, "open failed for %s/%s: %s\n",
+			path_prefix, path, strerror(errno));
+		exit(-1);
+	}
+	if (fd == -1)
+		return;
+
+	if (cache.file) {
+		/* not every filesystem has generations, 0 is fine then */
+		ioctl(fd, FS_IOC_GETVERSION, &gen);
+		key->gen = gen;
+		cached = cache_lookup(key);
+		/* a cached sum has no block sums */
+		if (cached && !cache.verify && !blocks_fp) {
+			memcpy(cs->out, cached->cs, cs_size);
+			cs->final = 1;
+			memcpy(key->cs, cs->out, cs_size);
+			cache_add(key);
+			pthread_mutex_lock(&cache.lock);
+			cache.hits++;
+			pthread_mutex_unlock(&cache.lock);
+			close(fd);
+			return;
+		}
+	}
+
+	if (blocks_fp)
+		blocks = blocks_new(key->size);
+	ret = sum_file_data(fd, cs, blocks);
+	if (ret < 0) {
+		fprintf(stderr, "read failed for %s/%s: %s\n",
+			path_prefix, path, strerror(errno));
+		exit(-1);
+	}
+	close(fd);
+	if (blocks) {
+		blocks_fini(blocks);
+		*blocksp = blocks;
+	}
+
+	if (cache.file) {
+		sum_fini(cs);
+		if (cached && memcmp(cached->cs, cs->out, cs_size))
+			fprintf(stderr, "stale cache entry for %s/%s\n",
+				path_prefix, path);
+		memcpy(key->cs, cs->out, cs_size);
+		cache_add(key);
+	}
+}
+
+void
+sum_special(int dirfd, char *name, struct stat64 *st, sum_t *cs)
+{
+	int ret;
+
+	if (S_ISLNK(st->st_mode)) {
+		ret = readlinkat(dirfd, name, buf, sizeof(buf));
+		if (ret == -1) {
+			perror("readlink");
+			exit(-1);
+		}
+		sum_add(cs, buf, ret);
+	} else if (S_ISCHR(st->st_mode) || S_ISBLK(st->st_mode)) {
+		sum_add_u64(cs, major(st->st_rdev));
+		sum_add_u64(cs, minor(st->st_rdev));
+	}
+}
+
+int
+is_excluded(char *path)
+{
+	int excl;
+
+	for (excl = 0; excl < n_excludes; ++excl) {
+		if (strncmp(excludes[excl].path, path,
+		    excludes[excl].len) == 0)
+			return 1;
+	}
+	return 0;
+}
+
+/*
+ * Write out and/or check the manifest line for one entry.  path needs room
+ * for one more character, a '/' is appended for directories.
+ */
+void
+manifest_entry(char *path, mode_t mode, sum_t *meta, sum_t *cs,
+	       struct block_sums *blocks)
+{
+	char *fn;
+	char *m;
+	char *c;
+
+	if (!gen_manifest && !in_manifest)
+		return;
+
+	if (S_ISDIR(mode))
+		strcat(path, "/");
+	fn = escape(path);
+	m = sum_to_string(meta);
+	c = sum_to_string(cs);
+
+	if (gen_manifest)
+		fprintf(out_fp, "%s %s %s\n", fn, m, c);
+	if (gen_manifest && blocks)
+		blocks_write(fn, blocks);
+	if (in_manifest)
+		check_manifest(fn, m, c, blocks, 0);
+	free(c);
+	free(m);
+	free(fn);
+}
+
+/*
+ * Sorted directory reader.  Names are read with getdents64 into an arena
+ * instead of one allocation each.  Once NAMES_SPILL_SIZE bytes of names have
+ * been collected, they are sorted and written out to a temporary file as a
+ * run, and the runs are merged when iterating.  That bounds the memory used
+ * for a directory no matter how many entries it has.
+ */
+#ifndef NAMES_SPILL_SIZE
+#define NAMES_SPILL_SIZE	(16 * 1024 * 1024)
+#endif
+#define NAMES_BLOCK_SIZE	65536
+/* more runs than this are merged into one, to bound open files */
+#define NAMES_MAX_RUNS		64
+
+struct names_run {
+	FILE	*fp;
+	int	valid;
+	char	name[NAME_MAX + 1];
+};
+
+struct names {
+	/* the arena, a list of blocks so names never move */
+	char			**blocks;
+	int			nr_blocks;
+	size_t			block_len;
+	size_t			arena_len;
+	char			**names;
+	int			nr;
+	int			alloc;
+	int			pos;
+	struct names_run	*runs;
+	int			nr_runs;
+};
+
+void
+names_free_arena(struct names *n)
+{
+	int i;
+
+	for (i = 0; i < n->nr_blocks; i++)
+		free(n->blocks[i]);
+	free(n->blocks);
+	n->blocks = NULL;
+	n->nr_blocks = 0;
+	n->arena_len = 0;
+}
+
+void
+names_add(struct names *n, const char *name)
+{
+	size_t len = strlen(name) + 1;
+
+	if (!n->nr_blocks || n->block_len + len > NAMES_BLOCK_SIZE) {
+		n->blocks = realloc(n->blocks,
+				    (n->nr_blocks + 1) * sizeof(*n->blocks));
+		if (!n->blocks) {
+			fprintf(stderr, "malloc failed\n");
+			exit(-1);
+		}
+		n->blocks[n->nr_blocks++] = alloc(NAMES_BLOCK_SIZE);
+		n->block_len = 0;
+	}
+	if (n->nr == n->alloc) {
+		n->alloc += CHUNKS;
+		n->names = realloc(n->names, n->alloc * sizeof(*n->names));
+		if (!n->names) {
+			fprintf(stderr, "malloc failed\n");
+			exit(-1);
+		}
+	}
+	n->names[n->nr++] = memcpy(n->blocks[n->nr_blocks - 1] + n->block_len,
+				   name, len);
+	n->block_len += len;
+	n->arena_len += len;
+}
+
+int
+names_run_read(struct names_run *run)
+{
+	unsigned char len;
+
+	run->valid = fread(&len, 1, 1, run->fp) == 1 &&
+		     fread(run->name, len, 1, run->fp) == 1;
+	run->name[run->valid ? len : 0] = 0;
+	return run->valid;
+}
+
+void
+names_write(FILE *fp, char *name)
+{
+	/* a name is at most NAME_MAX (255) bytes */
+	unsigned char len = strlen(name);
+
+	if (fwrite(&len, 1, 1, fp) != 1 || fwrite(name, len, 1, fp) != 1) {
+		perror("write directory entries");
+		exit(-1);
+	}
+}
+
+void
+names_rewind(struct names_run *run)
+{
+	if (fflush(run->fp) || fseek(run->fp, 0, SEEK_SET)) {
+		perror("write directory entries");
+		exit(-1);
+	}
+	names_run_read(run);
+}
+
+/* index of the run with the smallest next name, -1 once all are done */
+int
+names_min_run(struct names *n)
+{
+	int min = -1;
+	int i;
+
+	for (i = 0; i < n->nr_runs; i++) {
+		if (n->runs[i].valid &&
+		    (min < 0 || strcmp(n->runs[i].name, n->runs[min].name) < 0))
+			min = i;
+	}
+	return min;
+}
+
+void
+names_merge_runs(struct names *n)
+{
+	FILE *fp;
+	int i;
+
+	fp = tmpfile();
+	if (!fp) {
+		perror("tmpfile");
+		exit(-1);
+	}
+	while ((i = names_min_run(n)) >= 0) {
+		names_write(fp, n->runs[i].name);
+		names_run_read(&n->runs[i]);
+	}
+	for (i = 0; i < n->nr_runs; i++)
+		fclose(n->runs[i].fp);
+	n->runs[0].fp = fp;
+	n->nr_runs = 1;
+	names_rewind(&n->runs[0]);
+}
+
+void
+names_spill(struct names *n)
+{
+	struct names_run *run;
+	int i;
+
+	if (n->nr_runs == NAMES_MAX_RUNS)
+		names_merge_runs(n);
+	n->runs = realloc(n->runs, (n->nr_runs + 1) * sizeof(*n->runs));
+	if (!n->runs) {
+		fprintf(stderr, "malloc failed\n");
+		exit(-1);
+	}
+	run = &n->runs[n->nr_runs++];
+	run->fp = tmpfile();
+	if (!run->fp) {
+		perror("tmpfile");
+		exit(-1);
+	}
+	qsort(n->names, n->nr, sizeof(*n->names), namecmp);
+	for (i = 0; i < n->nr; i++)
+		names_write(run->fp, n->names[i]);
+	names_rewind(run);
+	n->nr = 0;
+	names_free_arena(n);
+}
+
+void
+names_open(struct names *n, int dirfd)
+{
+	struct dirent64 *de;
+	long ret;
+	long i;
+
+	memset(n, 0, sizeof(*n));
+	while (1) {
+		ret = syscall(SYS_getdents64, dirfd, buf, sizeof(buf));
+		if (ret < 0) {
+			perror("getdents64");
+			exit(-1);
+		}
+		if (ret == 0)
+			break;
+		for (i = 0; i < ret; i += de->d_reclen) {
+			de = (struct dirent64 *)(buf + i);
+			if (!strcmp(de->d_name, ".") ||
+			    !strcmp(de->d_name, ".."))
+				continue;
+			if (n->arena_len >= NAMES_SPILL_SIZE)
+				names_spill(n);
+			names_add(n, de->d_name);
+		}
+	}
+	if (n->nr_runs) {
+		names_spill(n);
+	} else {
+		qsort(n->names, n->nr, sizeof(*n->names), namecmp);
+	}
+}
+
+/* returns the next name in order, valid until the next call */
+char *
+names_next(struct names *n)
+{
+	int i;
+
+	if (!n->nr_runs)
+		return n->pos < n->nr ? n->names[n->pos++] : NULL;
+
+	if (n->pos) {
+		/* the name handed out last time, advance its run */
+		names_run_read(&n->runs[n->pos - 1]);
+	}
+	i = names_min_run(n);
+	if (i < 0)
+		return NULL;
+	n->pos = i + 1;
+	return n->runs[i].name;
+}
+
+void
+names_close(struct names *n)
+{
+	int i;
+
+	for (i = 0; i < n->nr_runs; i++)
+		fclose(n->runs[i].fp);
+	free(n->runs);
+	free(n->names);
+	names_free_arena(n);
+}
+
+void
+sum(int dirfd, int level, sum_t *dircs, char *path_prefix, char *path_in)
+{
+	struct names names;
+	char *name;
+	int ret;
+	int fd;
+	struct stat64 dir_st;
+
+	if (fstat64(dirfd, &dir_st)) {
+		perror("fstat");
+		exit(-1);
+	}
+
+	names_open(&names, dirfd);
+	while ((name = names_next(&names))) {
+		struct stat64 st;
+		struct block_sums *blocks = NULL;
+		sum_t cs;
+		sum_t meta;
+		char *path;
+
+		sum_init(&cs);
+		sum_init(&meta);
+		path = alloc(strlen(path_in) + strlen(name) + 3);
+		sprintf(path, "%s/%s", path_in, name);
+		if (is_excluded(path))
+			goto next;
+
+		ret = fstatat64(dirfd, name, &st, AT_SYMLINK_NOFOLLOW);
 		if (ret) {
 			fprintf(stderr, "stat failed for %s/%s: %s\n",
 				path_prefix, path, strerror(errno));
@@ -580,46 +1787,13 @@ sum(int dirfd, int level, sum_t *dircs, char *path_prefix, char *path_in)
 		if (st.st_dev != dir_st.st_dev)
 			goto next;
 
-		sum_add_u64(&meta, level);
-		sum_add(&meta, namelist[i], strlen(namelist[i]));
-		if (!S_ISDIR(st.st_mode))
-			sum_add_u64(&meta, st.st_nlink);
-		if (flags[FLAG_UID])
-			sum_add_u64(&meta, st.st_uid);
-		if (flags[FLAG_GID])
-			sum_add_u64(&meta, st.st_gid);
-		if (flags[FLAG_MODE])
-			sum_add_u64(&meta, st.st_mode);
-		if (flags[FLAG_ATIME])
-			sum_add_time(&meta, st.st_atime);
-		if (flags[FLAG_MTIME])
-			sum_add_time(&meta, st.st_mtime);
-		if (flags[FLAG_CTIME])
-			sum_add_time(&meta, st.st_ctime);
+		sum_add_stat(&meta, level, name, &st);
 		if (flags[FLAG_XATTRS] &&
-		    (S_ISDIR(st.st_mode) || S_ISREG(st.st_mode))) {
-			fd = openat(dirfd, namelist[i], 0);
-			if (fd == -1 && flags[FLAG_OPEN_ERROR]) {
-				sum_add_u64(&meta, errno);
-			} else if (fd == -1) {
-				fprintf(stderr, "open failed for %s/%s: %s\n",
-					path_prefix, path, strerror(errno));
-				exit(-1);
-			} else {
-				ret = sum_xattrs(fd, &meta);
-				close(fd);
-				if (ret < 0) {
-					fprintf(stderr,
-						"failed to read xattrs from "
-						"%s/%s: %s\n",
-						path_prefix, path,
-						strerror(-ret));
-					exit(-1);
-				}
-			}
-		}
+		    (S_ISDIR(st.st_mode) || S_ISREG(st.st_mode)))
+			sum_open_xattrs(dirfd, name, &meta, path_prefix,
+					path);
 		if (S_ISDIR(st.st_mode)) {
-			fd = openat(dirfd, namelist[i], 0);
+			fd = openat(dirfd, name, 0);
 			if (fd == -1 && flags[FLAG_OPEN_ERROR]) {
 				sum_add_u64(&meta, errno);
 			} else if (fd == -1) {
@@ -633,69 +1807,314 @@ sum(int dirfd, int level, sum_t *dircs, char *path_prefix, char *path_in)
 		} else if (S_ISREG(st.st_mode)) {
 			sum_add_u64(&meta, st.st_size);
 			if (flags[FLAG_DATA]) {
-				if (verbose)
-					fprintf(stderr, "file %s\n",
-						namelist[i]);
-				fd = openat(dirfd, namelist[i], 0);
-				if (fd == -1 && flags[FLAG_OPEN_ERROR]) {
-					sum_add_u64(&meta, errno);
-				} else if (fd == -1) {
-					fprintf(stderr,
-						"open failed for %s/%s: %s\n",
-						path_prefix, path,
-						strerror(errno));
-					exit(-1);
-				}
-				if (fd != -1) {
-					ret = sum_file_data(fd, &cs);
-					if (ret < 0) {
-						fprintf(stderr,
-							"read failed for "
-							"%s/%s: %s\n",
-							path_prefix, path,
-							strerror(errno));
-						exit(-1);
-					}
-					close(fd);
-				}
-			}
-		} else if (S_ISLNK(st.st_mode)) {
-			ret = readlink(namelist[i], buf, sizeof(buf));
-			if (ret == -1) {
-				perror("readlink");
-				exit(-1);
+				struct cache_entry key;
+
+				cache_key_init(&key, &st);
+				sum_open_data(dirfd, name, &key, &meta,
+					      &cs, &blocks, path_prefix, path);
 			}
-			sum_add(&cs, buf, ret);
-		} else if (S_ISCHR(st.st_mode) || S_ISBLK(st.st_mode)) {
-			sum_add_u64(&cs, major(st.st_rdev));
-			sum_add_u64(&cs, minor(st.st_rdev));
+		} else {
+			sum_special(dirfd, name, &st, &cs);
 		}
 		sum_fini(&cs);
 		sum_fini(&meta);
-		if (gen_manifest || in_manifest) {
-			char *fn;
-			char *m;
-			char *c;
-
-			if (S_ISDIR(st.st_mode))
-				strcat(path, "/");
-			fn = escape(path);
-			m = sum_to_string(&meta);
-			c = sum_to_string(&cs);
-
-			if (gen_manifest)
-				fprintf(out_fp, "%s %s %s\n", fn, m, c);
-			if (in_manifest)
-				check_manifest(fn, m, c, 0);
-			free(c);
-			free(m);
-			free(fn);
-		}
+		manifest_entry(path, st.st_mode, &meta, &cs, blocks);
+		blocks_free(blocks);
 		sum_add_sum(dircs, &cs);
 		sum_add_sum(dircs, &meta);
 next:
 		free(path);
 	}
+	names_close(&names);
+}
+
+/*
+ * Parallel walk (-j).  Every directory and every regular file whose data we
+ * hash becomes a task for a pool of threads.  A node is complete once its own
+ * task and those of all its children are done, at which point a directory
+ * sums up its children in name order, exactly as sum() would.  When the root
+ * is complete the tree is walked once more in order to write or check the
+ * manifest, so the output is identical to a serial run.
+ */
+struct pnode {
+	struct pnode *parent;
+	struct pnode **children;
+	int nr_children;
+	char *path;
+	int level;
+	mode_t mode;
+	int pending;
+	struct cache_entry key;
+	struct block_sums *blocks;
+	sum_t cs;
+	sum_t meta;
+};
+
+struct {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	struct pnode **tasks;
+	int nr_tasks;
+	int alloc_tasks;
+	int done;
+	char *path_prefix;
+} pool = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.cond = PTHREAD_COND_INITIALIZER,
+};
+
+/* called with pool.lock held */
+void
+pool_push(struct pnode *node)
+{
+	if (pool.nr_tasks == pool.alloc_tasks) {
+		pool.alloc_tasks += CHUNKS;
+		pool.tasks = realloc(pool.tasks,
+				     pool.alloc_tasks * sizeof(*pool.tasks));
+		if (!pool.tasks) {
+			fprintf(stderr, "malloc failed\n");
+			exit(-1);
+		}
+	}
+	pool.tasks[pool.nr_tasks++] = node;
+	pthread_cond_signal(&pool.cond);
+}
+
+/*
+ * Drop one pending reference from node, finishing it and then its parents
+ * once nothing below them is outstanding anymore.
+ */
+void
+pnode_put(struct pnode *node)
+{
+	int i;
+
+	while (node) {
+		pthread_mutex_lock(&pool.lock);
+		if (--node->pending) {
+			pthread_mutex_unlock(&pool.lock);
+			return;
+		}
+		pthread_mutex_unlock(&pool.lock);
+
+		if (S_ISDIR(node->mode)) {
+			for (i = 0; i < node->nr_children; i++) {
+				sum_add_sum(&node->cs, &node->children[i]->cs);
+				sum_add_sum(&node->cs,
+					    &node->children[i]->meta);
+			}
+			sum_fini(&node->cs);
+			sum_fini(&node->meta);
+		}
+		if (!node->parent) {
+			pthread_mutex_lock(&pool.lock);
+			pool.done = 1;
+			pthread_cond_broadcast(&pool.cond);
+			pthread_mutex_unlock(&pool.lock);
+		}
+		node = node->parent;
+	}
+}
+
+char *
+pnode_fullpath(struct pnode *node)
+{
+	char *p = alloc(strlen(pool.path_prefix) + strlen(node->path) + 1);
+
+	sprintf(p, "%s%s", pool.path_prefix, node->path);
+	return p;
+}
+
+void
+pwalk_file(struct pnode *node)
+{
+	char *fullpath = pnode_fullpath(node);
+
+	sum_open_data(AT_FDCWD, fullpath, &node->key, &node->meta, &node->cs,
+		      &node->blocks, pool.path_prefix, node->path);
+	free(fullpath);
+	sum_fini(&node->cs);
+	sum_fini(&node->meta);
+	pnode_put(node->parent);
+}
+
+void
+pwalk_dir(struct pnode *node)
+{
+	struct stat64 dir_st;
+	struct names names;
+	char *name;
+	char *fullpath;
+	int alloc_children = 0;
+	int dirfd;
+
+	fullpath = pnode_fullpath(node);
+	dirfd = open(fullpath, O_RDONLY);
+	free(fullpath);
+	if (dirfd == -1 && node->parent && flags[FLAG_OPEN_ERROR]) {
+		sum_add_u64(&node->meta, errno);
+		goto out;
+	} else if (dirfd == -1) {
+		fprintf(stderr, "open failed for %s/%s: %s\n",
+			pool.path_prefix, node->path, strerror(errno));
+		exit(-1);
+	}
+	if (fstat64(dirfd, &dir_st)) {
+		perror("fstat");
+		exit(-1);
+	}
+
+	names_open(&names, dirfd);
+	while ((name = names_next(&names))) {
+		struct pnode *child;
+		struct stat64 st;
+		char *path;
+
+		path = alloc(strlen(node->path) + strlen(name) + 3);
+		sprintf(path, "%s/%s", node->path, name);
+		if (is_excluded(path))
+			goto skip;
+
+		if (fstatat64(dirfd, name, &st, AT_SYMLINK_NOFOLLOW)) {
+			fprintf(stderr, "stat failed for %s/%s: %s\n",
+				pool.path_prefix, path, strerror(errno));
+			exit(-1);
+		}
+
+		/* We are crossing into a different subvol, skip this subtree. */
+		if (st.st_dev != dir_st.st_dev)
+			goto skip;
+
+		child = alloc(sizeof(*child));
+		memset(child, 0, sizeof(*child));
+		child->parent = node;
+		child->path = path;
+		child->level = node->level + 1;
+		child->mode = st.st_mode;
+		child->pending = 1;
+		sum_init(&child->cs);
+		sum_init(&child->meta);
+		if (node->nr_children == alloc_children) {
+			alloc_children += CHUNKS;
+			node->children = realloc(node->children,
+				alloc_children * sizeof(*node->children));
+			if (!node->children) {
+				fprintf(stderr, "malloc failed\n");
+				exit(-1);
+			}
+		}
+		node->children[node->nr_children++] = child;
+
+		sum_add_stat(&child->meta, child->level, name, &st);
+		if (flags[FLAG_XATTRS] &&
+		    (S_ISDIR(st.st_mode) || S_ISREG(st.st_mode)))
+			sum_open_xattrs(dirfd, name, &child->meta,
+					pool.path_prefix, path);
+		if (S_ISDIR(st.st_mode) ||
+		    (S_ISREG(st.st_mode) && flags[FLAG_DATA])) {
+			if (S_ISREG(st.st_mode)) {
+				sum_add_u64(&child->meta, st.st_size);
+				cache_key_init(&child->key, &st);
+			}
+			pthread_mutex_lock(&pool.lock);
+			node->pending++;
+			pool_push(child);
+			pthread_mutex_unlock(&pool.lock);
+			continue;
+		}
+		if (S_ISREG(st.st_mode))
+			sum_add_u64(&child->meta, st.st_size);
+		else
+			sum_special(dirfd, name, &st, &child->cs);
+		sum_fini(&child->cs);
+		sum_fini(&child->meta);
+		continue;
+skip:
+		free(path);
+	}
+	names_close(&names);
+	close(dirfd);
+out:
+	pnode_put(node);
+}
+
+void *
+pool_worker(void *arg)
+{
+	struct pnode *node;
+
+	pthread_mutex_lock(&pool.lock);
+	while (1) {
+		while (!pool.done && !pool.nr_tasks)
+			pthread_cond_wait(&pool.cond, &pool.lock);
+		if (pool.done)
+			break;
+		/* LIFO keeps the walk depth first and the queue short */
+		node = pool.tasks[--pool.nr_tasks];
+		pthread_mutex_unlock(&pool.lock);
+		if (S_ISDIR(node->mode))
+			pwalk_dir(node);
+		else
+			pwalk_file(node);
+		pthread_mutex_lock(&pool.lock);
+	}
+	pthread_mutex_unlock(&pool.lock);
+	return NULL;
+}
+
+/* Write/check the manifest in sum() order and free the tree as we go */
+void
+pemit(struct pnode *node)
+{
+	int i;
+
+	for (i = 0; i < node->nr_children; i++) {
+		struct pnode *child = node->children[i];
+
+		if (S_ISDIR(child->mode))
+			pemit(child);
+		manifest_entry(child->path, child->mode, &child->meta,
+			       &child->cs, child->blocks);
+		blocks_free(child->blocks);
+		free(child->path);
+		free(child);
+	}
+	free(node->children);
+}
+
+void
+sum_parallel(char *path_prefix, int nr_threads, sum_t *cs)
+{
+	struct pnode root;
+	pthread_t *threads;
+	int i;
+	int ret;
+
+	memset(&root, 0, sizeof(root));
+	root.path = "";
+	root.mode = S_IFDIR;
+	root.pending = 1;
+	sum_init(&root.cs);
+	sum_init(&root.meta);
+	pool.path_prefix = path_prefix;
+	pool_push(&root);
+
+	threads = alloc(nr_threads * sizeof(*threads));
+	for (i = 0; i < nr_threads; i++) {
+		ret = pthread_create(&threads[i], NULL, pool_worker, NULL);
+		if (ret) {
+			fprintf(stderr, "failed to create thread: %s\n",
+				strerror(ret));
+			exit(-1);
+		}
+	}
+	for (i = 0; i < nr_threads; i++)
+		pthread_join(threads[i], NULL);
+	free(threads);
+	free(pool.tasks);
+
+	pemit(&root);
+	*cs = root.cs;
 }
 
 int
@@ -707,12 +2126,12 @@ main(int argc, char *argv[])
 	char *path;
 	int fd;
 	sum_t cs;
-	char flagstring[sizeof(flchar)];
+	char flagstring[sizeof(flchar) + 16];
 	int i;
 	int plen;
 	int elen;
 	int n_flags = 0;
-	const char *allopts = "heEfuUgGoOaAmMcCdDtTsSnNw:r:vx:";
+	const char *allopts = "heEfuUgGoOaAmMcCdDtTsSnNw:r:vx:j:H:k:Kb:B:I";
 
 	out_fp = stdout;
 	while ((c = getopt(argc, argv, allopts)) != EOF) {
@@ -783,6 +2202,52 @@ main(int argc, char *argv[])
 		case 'v':
 			++verbose;
 			break;
+		case 'j':
+			nr_threads = atoi(optarg);
+			if (nr_threads < 1) {
+				fprintf(stderr, "invalid number of threads\n");
+				exit(-1);
+			}
+			break;
+		case 'H':
+			parse_hash(optarg);
+			break;
+		case 'k':
+			cache.file = optarg;
+			break;
+		case 'K':
+			cache.verify = 1;
+			break;
+		case 'b':
+			blocks_file = optarg;
+			break;
+		case 'I':
+			direct_io = 1;
+			break;
+		case 'B': {
+			char *end;
+
+			block_size = strtoull(optarg, &end, 0);
+			switch (*end) {
+			case 'g':
+			case 'G':
+				block_size <<= 10;
+				/* fall through */
+			case 'm':
+			case 'M':
+				block_size <<= 10;
+				/* fall through */
+			case 'k':
+			case 'K':
+				block_size <<= 10;
+			}
+			if (!block_size) {
+				fprintf(stderr, "invalid block size %s\n",
+					optarg);
+				exit(-1);
+			}
+			break;
+		}
 		case 'h':
 		case '?':
 			usage();
@@ -805,10 +2270,10 @@ main(int argc, char *argv[])
 		if (strncmp(l, "Flags: ", 7) == 0) {
 			l += 7;
 			in_manifest = 1;
-			parse_flags(l);
+			parse_flags_hash(l);
 		} else if ((p = strchr(l, ':'))) {
 			*p++ = 0;
-			parse_flags(l);
+			parse_flags_hash(l);
 			checksum = strdup(p);
 		} else {
 			fprintf(stderr, "invalid input file format\n");
@@ -823,6 +2288,11 @@ main(int argc, char *argv[])
 		if (flags[i] == 0)
 			flagstring[i] -= 'a' - 'A';
 	}
+	/* md5 is left implicit so older versions can still read the output */
+	if (hash != HASH_MD5) {
+		strcat(flagstring, ",");
+		strcat(flagstring, hash_algos[hash].name);
+	}
 
 	path = argv[optind];
 	plen = strlen(path);
@@ -855,13 +2325,48 @@ main(int argc, char *argv[])
 	if (gen_manifest)
 		fprintf(out_fp, "Flags: %s\n", flagstring);
 
-	sum_init(&cs);
-	sum(fd, 1, &cs, path, "");
-	sum_fini(&cs);
+	if (cache.file)
+		cache_load();
 
-	close(fd);
+	if (blocks_file && gen_manifest) {
+		blocks_fp = fopen(blocks_file, "w");
+		if (!blocks_fp) {
+			fprintf(stderr, "failed to open %s: %s\n",
+				blocks_file, strerror(errno));
+			exit(-1);
+		}
+		blocks_write_header();
+	} else if (blocks_file && in_manifest) {
+		blocks_fp = fopen(blocks_file, "r");
+		if (!blocks_fp) {
+			fprintf(stderr, "failed to open %s: %s\n",
+				blocks_file, strerror(errno));
+			exit(-1);
+		}
+		blocks_read_header();
+		blocks_read_next();
+	} else if (blocks_file) {
+		fprintf(stderr, "-b needs -f or a manifest to check\n");
+		exit(-1);
+	}
+
+	if (nr_threads > 1) {
+		close(fd);
+		sum_parallel(path, nr_threads, &cs);
+	} else {
+		sum_init(&cs);
+		sum(fd, 1, &cs, path, "");
+		sum_fini(&cs);
+		close(fd);
+	}
 	if (in_manifest)
-		check_manifest("", "", "", 1);
+		check_manifest("", "", "", NULL, 1);
+	if (cache.file)
+		cache_save();
+	if (blocks_fp && fclose(blocks_fp)) {
+		perror("write block sums");
+		exit(-1);
+	}
 
 	if (!checksum) {
 		if (in_manifest) {
@@ -0,0 +1,436 @@
+// SPDX-License-Identifier: GPL-2.0
+#include <stdio.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include "log-writes.h"
+
+enum option_indexes {
+	LOG,
+	OUTPUT,
+	STATS,
+	VERBOSE,
+};
+
+static struct option long_options[] = {
+	{"log", required_argument, NULL, 0},
+	{"output", required_argument, NULL, 0},
+	{"stats", no_argument, NULL, 0},
+	{"verbose", no_argument, NULL, 'v'},
+	{ NULL, 0, NULL, 0 },
+};
+
+static void usage(void)
+{
+	fprintf(stderr, "Usage: log-compact --log <logfile> [options]\n");
+	fprintf(stderr, "\t--output <logfile> - write a compacted copy of the "
+		"log\n");
+	fprintf(stderr, "\t--stats - print statistics about the log\n");
+	fprintf(stderr, "\t-v or --verbose - print dropped entries\n");
+	exit(1);
+}
+
+/*
+ * Entries with any of these flags are never dropped, and they end an epoch:
+ * writes after them never make writes before them redundant.  A flush or fua
+ * write does supersede the earlier writes of its own epoch that it covers,
+ * since replaying to it replays its data too.  That way replaying the
+ * compacted log to any flush, fua or mark gives the same result as replaying
+ * the original log to the same point.
+ */
+#define BARRIER_FLAGS	(LOG_FLUSH_FLAG | LOG_FUA_FLAG | LOG_DISCARD_FLAG | \
+			 LOG_MARK_FLAG)
+
+/*
+ * A sorted set of non-overlapping sector ranges, [start, end).
+ */
+struct range_set {
+	u64 *start;
+	u64 *end;
+	u64 nr;
+	u64 size;
+};
+
+/* Index of the first range that ends at or after @sector */
+static u64 range_find(struct range_set *set, u64 sector)
+{
+	u64 lo = 0, hi = set->nr;
+
+	while (lo < hi) {
+		u64 mid = lo + (hi - lo) / 2;
+
+		if (set->end[mid] < sector)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+static int range_covered(struct range_set *set, u64 start, u64 end)
+{
+	u64 i = range_find(set, start);
+
+	return i < set->nr && set->start[i] <= start && set->end[i] >= end;
+}
+
+static int range_add(struct range_set *set, u64 start, u64 end)
+{
+	u64 i = range_find(set, start);
+	u64 j = i;
+
+	/* Merge with every range we overlap or touch */
+	while (j < set->nr && set->start[j] <= end) {
+		if (set->start[j] < start)
+			start = set->start[j];
+		if (set->end[j] > end)
+			end = set->end[j];
+		j++;
+	}
+
+	if (j == i) {
+		if (set->nr == set->size) {
+			u64 size = set->size ? set->size * 2 : 1024;
+			u64 *s = realloc(set->start, size * sizeof(u64));
+			u64 *e;
+
+			if (!s)
+				return -1;
+			set->start = s;
+			e = realloc(set->end, size * sizeof(u64));
+			if (!e)
+				return -1;
+			set->end = e;
+			set->size = size;
+		}
+		memmove(&set->start[i + 1], &set->start[i],
+			(set->nr - i) * sizeof(u64));
+		memmove(&set->end[i + 1], &set->end[i],
+			(set->nr - i) * sizeof(u64));
+		set->nr++;
+		j = i + 1;
+	} else if (j > i + 1) {
+		memmove(&set->start[i + 1], &set->start[j],
+			(set->nr - j) * sizeof(u64));
+		memmove(&set->end[i + 1], &set->end[j],
+			(set->nr - j) * sizeof(u64));
+		set->nr -= j - i - 1;
+	}
+	set->start[i] = start;
+	set->end[i] = end;
+	return 0;
+}
+
+static u64 range_total(struct range_set *set)
+{
+	u64 total = 0;
+	u64 i;
+
+	for (i = 0; i < set->nr; i++)
+		total += set->end[i] - set->start[i];
+	return total;
+}
+
+static void range_free(struct range_set *set)
+{
+	free(set->start);
+	free(set->end);
+	memset(set, 0, sizeof(*set));
+}
+
+static int is_write(struct log_index_entry *ie)
+{
+	return ie->nr_sectors && !(ie->flags & LOG_DISCARD_FLAG);
+}
+
+/*
+ * Walk every epoch backwards and drop the plain writes whose sectors are all
+ * written again later in the same epoch.  @keep gets one byte per entry.
+ */
+static int find_superseded(struct log *log, char *keep)
+{
+	struct log_index *index = log->index;
+	struct range_set covered = { 0 };
+	u64 i = index->nr_entries;
+	int ret = 0;
+
+	while (i-- > 0 && !ret) {
+		struct log_index_entry *ie = &index->entries[i];
+		u64 end = ie->sector + ie->nr_sectors;
+
+		keep[i] = 1;
+		if (ie->flags & BARRIER_FLAGS) {
+			/* Writes before this entry belong to an earlier epoch */
+			covered.nr = 0;
+			if (is_write(ie))
+				ret = range_add(&covered, ie->sector, end);
+			continue;
+		}
+		if (!is_write(ie))
+			continue;
+		if (range_covered(&covered, ie->sector, end)) {
+			keep[i] = 0;
+			if (log_writes_verbose)
+				printf("dropping entry %llu: sector %llu, "
+				       "size %llu\n", (unsigned long long)i,
+				       (unsigned long long)ie->sector,
+				       (unsigned long long)ie->nr_sectors *
+				       log->sectorsize);
+			continue;
+		}
+		ret = range_add(&covered, ie->sector, end);
+	}
+	range_free(&covered);
+	if (ret)
+		fprintf(stderr, "Couldn't allocate memory\n");
+	return ret;
+}
+
+/*
+ * Copy the super block and every entry we keep to @outfile, the entries are
+ * copied verbatim so marks and flags are preserved.
+ */
+static int write_compacted(struct log *log, char *keep, char *outfile)
+{
+	struct log_index *index = log->index;
+	struct log_write_super super;
+	u64 nr_kept = 0;
+	size_t bufsize = log->sectorsize;
+	char *buf;
+	FILE *fp;
+	u64 i;
+
+	for (i = 0; i < index->nr_entries; i++)
+		nr_kept += keep[i];
+
+	buf = calloc(1, bufsize);
+	fp = fopen(outfile, "w");
+	if (!buf || !fp) {
+		fprintf(stderr, "Couldn't create %s: %d\n", outfile, errno);
+		goto out;
+	}
+
+	if (pread(log->logfd, buf, log->sectorsize, 0) != log->sectorsize)
+		goto out_read;
+	memcpy(&super, buf, sizeof(super));
+	super.nr_entries = cpu_to_le64(nr_kept);
+	memcpy(buf, &super, sizeof(super));
+	if (fwrite(buf, log->sectorsize, 1, fp) != 1)
+		goto out_write;
+
+	for (i = 0; i < index->nr_entries; i++) {
+		struct log_index_entry *ie = &index->entries[i];
+		size_t len = log->sectorsize;
+
+		if (!keep[i])
+			continue;
+		if (is_write(ie))
+			len += ie->nr_sectors * log->sectorsize;
+		if (len > bufsize) {
+			char *newbuf = realloc(buf, len);
+
+			if (!newbuf) {
+				fprintf(stderr, "Couldn't allocate memory\n");
+				goto out;
+			}
+			buf = newbuf;
+			bufsize = len;
+		}
+		if (pread(log->logfd, buf, len, ie->pos) != len)
+			goto out_read;
+		if (fwrite(buf, len, 1, fp) != 1)
+			goto out_write;
+	}
+
+	if (fclose(fp)) {
+		fp = NULL;
+		goto out_write;
+	}
+	free(buf);
+	return 0;
+
+out_read:
+	fprintf(stderr, "Error reading log: %d\n", errno);
+	goto out;
+out_write:
+	fprintf(stderr, "Error writing %s: %d\n", outfile, errno);
+out:
+	if (fp)
+		fclose(fp);
+	free(buf);
+	unlink(outfile);
+	return -1;
+}
+
+#define NR_FLAG_TYPES	6
+#define NR_SIZE_BUCKETS	40
+
+static const char *flag_names[NR_FLAG_TYPES] = {
+	"FLUSH", "FUA", "DISCARD", "MARK", "METADATA", "NONE",
+};
+
+static void print_bytes(const char *name, u64 entries, u64 bytes)
+{
+	printf("  %-10s %12llu %16llu\n", name, (unsigned long long)entries,
+	       (unsigned long long)bytes);
+}
+
+static int print_stats(struct log *log, char *keep)
+{
+	struct log_index *index = log->index;
+	struct range_set written = { 0 };
+	u64 flag_entries[NR_FLAG_TYPES] = { 0 };
+	u64 flag_bytes[NR_FLAG_TYPES] = { 0 };
+	u64 sizes[NR_SIZE_BUCKETS] = { 0 };
+	u64 write_bytes = 0, kept_bytes = 0, nr_kept = 0;
+	u64 nr_epochs = 0, epoch_entries = 0;
+	u64 min_epoch = -1ULL, max_epoch = 0;
+	u64 i;
+	int bit;
+
+	for (i = 0; i < index->nr_entries; i++) {
+		struct log_index_entry *ie = &index->entries[i];
+		u64 bytes = ie->nr_sectors * log->sectorsize;
+
+		if (!(ie->flags & ((1 << (NR_FLAG_TYPES - 1)) - 1))) {
+			flag_entries[NR_FLAG_TYPES - 1]++;
+			flag_bytes[NR_FLAG_TYPES - 1] += bytes;
+		}
+		for (bit = 0; bit < NR_FLAG_TYPES - 1; bit++) {
+			if (ie->flags & (1 << bit)) {
+				flag_entries[bit]++;
+				flag_bytes[bit] += bytes;
+			}
+		}
+
+		if (is_write(ie)) {
+			int bucket = 0;
+
+			while ((2ULL << bucket) <= bytes &&
+			       bucket < NR_SIZE_BUCKETS - 1)
+				bucket++;
+			sizes[bucket]++;
+			write_bytes += bytes;
+			if (keep[i])
+				kept_bytes += bytes;
+			if (range_add(&written, ie->sector,
+				      ie->sector + ie->nr_sectors)) {
+				fprintf(stderr, "Couldn't allocate memory\n");
+				range_free(&written);
+				return -1;
+			}
+		}
+		nr_kept += keep[i];
+
+		epoch_entries++;
+		if ((ie->flags & LOG_FLUSH_FLAG) || i == index->nr_entries - 1) {
+			nr_epochs++;
+			if (epoch_entries < min_epoch)
+				min_epoch = epoch_entries;
+			if (epoch_entries > max_epoch)
+				max_epoch = epoch_entries;
+			epoch_entries = 0;
+		}
+	}
+
+	printf("Log sectorsize=%llu, entries=%llu\n",
+	       (unsigned long long)log->sectorsize,
+	       (unsigned long long)index->nr_entries);
+	printf("  %-10s %12s %16s\n", "flags", "entries", "bytes");
+	for (bit = 0; bit < NR_FLAG_TYPES; bit++)
+		print_bytes(flag_names[bit], flag_entries[bit],
+			    flag_bytes[bit]);
+
+	printf("Write sizes:\n");
+	for (bit = 0; bit < NR_SIZE_BUCKETS; bit++) {
+		if (sizes[bit])
+			printf("  >= %-12llu %12llu\n", 1ULL << bit,
+			       (unsigned long long)sizes[bit]);
+	}
+
+	printf("Flush epochs: %llu, entries per epoch min %llu avg %llu "
+	       "max %llu\n", (unsigned long long)nr_epochs,
+	       (unsigned long long)(nr_epochs ? min_epoch : 0),
+	       (unsigned long long)(nr_epochs ?
+				    index->nr_entries / nr_epochs : 0),
+	       (unsigned long long)max_epoch);
+	printf("Bytes written: %llu, distinct bytes: %llu, rewrite "
+	       "amplification: %.2f\n", (unsigned long long)write_bytes,
+	       (unsigned long long)(range_total(&written) * log->sectorsize),
+	       written.nr ? (double)write_bytes /
+	       (range_total(&written) * log->sectorsize) : 0.0);
+	printf("Compacted entries: %llu, compacted bytes: %llu\n",
+	       (unsigned long long)nr_kept, (unsigned long long)kept_bytes);
+	range_free(&written);
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	char *logfile = NULL, *outfile = NULL;
+	struct log *log;
+	char *keep;
+	int print = 0;
+	int opt_index;
+	int ret;
+	int c;
+
+	while ((c = getopt_long(argc, argv, "v", long_options,
+				&opt_index)) >= 0) {
+		switch(c) {
+		case 'v':
+			log_writes_verbose++;
+			continue;
+		case '?':
+			usage();
+		default:
+			break;
+		}
+
+		switch(opt_index) {
+		case LOG:
+			logfile = optarg;
+			break;
+		case OUTPUT:
+			outfile = optarg;
+			break;
+		case STATS:
+			print = 1;
+			break;
+		default:
+			usage();
+		}
+	}
+
+	if (!logfile || (!outfile && !print))
+		usage();
+
+	log = log_open(logfile, NULL);
+	if (!log)
+		exit(1);
+
+	ret = log_build_index(log);
+	if (ret) {
+		log_free(log);
+		exit(1);
+	}
+
+	keep = malloc(log->nr_entries + 1);
+	if (!keep) {
+		fprintf(stderr, "Couldn't allocate memory\n");
+		log_free(log);
+		exit(1);
+	}
+
+	ret = find_superseded(log, keep);
+	if (!ret && print)
+		ret = print_stats(log, keep);
+	if (!ret && outfile)
+		ret = write_compacted(log, keep, outfile);
+
+	free(keep);
+	log_free(log);
+	return ret ? 1 : 0;
+}
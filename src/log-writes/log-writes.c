@@ -9,10 +9,27 @@
 #include <errno.h>
 #include <unistd.h>
 #include <string.h>
+#include <stddef.h>
+#include <pthread.h>
 #include "log-writes.h"
 
 int log_writes_verbose = 0;
 
+static void log_stop_threads(struct log *log);
+
+static void log_free_index(struct log_index *index)
+{
+	u64 i;
+
+	if (!index)
+		return;
+	for (i = 0; i < index->nr_marks; i++)
+		free(index->marks[i].name);
+	free(index->marks);
+	free(index->entries);
+	free(index);
+}
+
 /*
  * @log: the log to free.
  *
@@ -24,6 +41,13 @@ void log_free(struct log *log)
 		close(log->replayfd);
 	if (log->logfd >= 0)
 		close(log->logfd);
+	log_free_index(log->index);
+	log_stop_threads(log);
+	free(log->zero_buf);
+	free(log->rbuf);
+	free(log->iov);
+	free(log->runs);
+	free(log->replayfile);
 	free(log);
 }
 
@@ -42,9 +66,8 @@ static int discard_range(struct log *log, u64 start, u64 len)
 
 static int zero_range(struct log *log, u64 start, u64 len)
 {
-	u64 bufsize = len;
+	u64 bufsize = LOG_ZERO_BUF_SIZE;
 	ssize_t ret;
-	char *buf = NULL;
 
 	if (log->max_zero_size < len) {
 		if (log_writes_verbose)
@@ -54,31 +77,27 @@ static int zero_range(struct log *log, u64 start, u64 len)
 		return 0;
 	}
 
-	while (!buf) {
-		buf = malloc(bufsize);
-		if (!buf)
-			bufsize >>= 1;
-		if (!bufsize) {
+	/* The zero buffer is allocated once and reused for every discard */
+	if (!log->zero_buf) {
+		log->zero_buf = calloc(1, LOG_ZERO_BUF_SIZE);
+		if (!log->zero_buf) {
 			fprintf(stderr, "Couldn't allocate zero buffer");
 			return -1;
 		}
 	}
 
-	memset(buf, 0, bufsize);
 	while (len) {
 		if (len < bufsize)
 			bufsize = len;
 
-		ret = pwrite(log->replayfd, buf, bufsize, start);
+		ret = pwrite(log->replayfd, log->zero_buf, bufsize, start);
 		if (ret != bufsize) {
 			fprintf(stderr, "Error zeroing file: %d\n", errno);
-			free(buf);
 			return -1;
 		}
 		len -= ret;
 		start += ret;
 	}
-	free(buf);
 	return 0;
 }
 
@@ -215,6 +234,314 @@ int log_entry_valid(struct log_write_entry *entry)
 	return 1;
 }
 
+/*
+ * @log: the log we are reading.
+ * @pos: the offset in the log we want.
+ * @len: the number of bytes we want.
+ * @ahead: the number of bytes to read if we have to go to the log.
+ *
+ * @return: a pointer to the data in our read buffer, NULL if there was an
+ * error.
+ *
+ * All reads of the log go through one buffer holding a window of the log, so
+ * replaying lots of small entries is a few large sequential reads instead of
+ * a read per entry.  The data stays valid until the window moves.  Queued
+ * writes point into the window, so they are submitted before it moves.
+ */
+static char *log_read(struct log *log, off_t pos, size_t len, size_t ahead)
+{
+	size_t done = 0;
+	ssize_t ret;
+
+	if (pos >= log->rbuf_start &&
+	    pos + len <= log->rbuf_start + log->rbuf_len)
+		return log->rbuf + (pos - log->rbuf_start);
+
+	if (log_submit_writes(log))
+		return NULL;
+
+	log->rbuf_len = 0;
+	if (ahead < len)
+		ahead = len;
+	if (ahead > log->rbuf_size) {
+		if (len > log->rbuf_size) {
+			char *buf = realloc(log->rbuf, len);
+
+			if (!buf) {
+				fprintf(stderr, "Error allocating buffer %llu\n",
+					(unsigned long long)len);
+				return NULL;
+			}
+			log->rbuf = buf;
+			log->rbuf_size = len;
+		}
+		ahead = log->rbuf_size;
+	}
+
+	while (done < ahead) {
+		ret = pread(log->logfd, log->rbuf + done, ahead - done,
+			    pos + done);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret < 0)
+			return NULL;
+		if (ret == 0)
+			break;
+		done += ret;
+	}
+	log->rbuf_start = pos;
+	log->rbuf_len = done;
+	if (done < len)
+		return NULL;
+	return log->rbuf;
+}
+
+/*
+ * Write out one run of adjacent queued writes with as few pwritev() calls as
+ * we can.
+ */
+static int log_write_run(struct log *log, struct log_run *run)
+{
+	struct iovec *iov = &log->iov[run->first_iov];
+	int nr_iov = run->nr_iov;
+	u64 offset = run->start;
+	ssize_t ret;
+
+	while (nr_iov) {
+		ret = pwritev(log->replayfd, iov, nr_iov, offset);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret <= 0) {
+			fprintf(stderr, "Error writing data: %d\n", errno);
+			return -1;
+		}
+		offset += ret;
+		while (nr_iov && ret >= iov->iov_len) {
+			ret -= iov->iov_len;
+			iov++;
+			nr_iov--;
+		}
+		if (ret) {
+			iov->iov_base = (char *)iov->iov_base + ret;
+			iov->iov_len -= ret;
+		}
+	}
+	return 0;
+}
+
+/*
+ * The replay threads, see log_set_threads().  Each time log_submit_writes()
+ * bumps the generation every thread wakes up and grabs runs to write until
+ * there are none left.
+ */
+struct log_pool {
+	pthread_t *threads;
+	int nr_threads;
+	pthread_mutex_t lock;
+	pthread_cond_t work_cond;
+	pthread_cond_t done_cond;
+	u64 generation;
+	int next_run;
+	int nr_busy;
+	int error;
+	int exit;
+};
+
+static void *log_pool_worker(void *arg)
+{
+	struct log *log = arg;
+	struct log_pool *pool = log->pool;
+	u64 generation = 0;
+	int ret;
+
+	pthread_mutex_lock(&pool->lock);
+	while (1) {
+		while (!pool->exit && pool->generation == generation)
+			pthread_cond_wait(&pool->work_cond, &pool->lock);
+		if (pool->exit)
+			break;
+		generation = pool->generation;
+		while (pool->next_run < log->nr_runs) {
+			struct log_run *run = &log->runs[pool->next_run++];
+
+			pthread_mutex_unlock(&pool->lock);
+			ret = log_write_run(log, run);
+			pthread_mutex_lock(&pool->lock);
+			if (ret)
+				pool->error = ret;
+		}
+		if (--pool->nr_busy == 0)
+			pthread_cond_signal(&pool->done_cond);
+	}
+	pthread_mutex_unlock(&pool->lock);
+	return NULL;
+}
+
+static void log_stop_threads(struct log *log)
+{
+	struct log_pool *pool = log->pool;
+	int i;
+
+	if (!pool)
+		return;
+
+	pthread_mutex_lock(&pool->lock);
+	pool->exit = 1;
+	pthread_cond_broadcast(&pool->work_cond);
+	pthread_mutex_unlock(&pool->lock);
+	for (i = 0; i < pool->nr_threads; i++)
+		pthread_join(pool->threads[i], NULL);
+
+	pthread_mutex_destroy(&pool->lock);
+	pthread_cond_destroy(&pool->work_cond);
+	pthread_cond_destroy(&pool->done_cond);
+	free(pool->threads);
+	free(pool);
+	log->pool = NULL;
+	log->max_runs = 1;
+}
+
+/*
+ * @log: the log we are replaying.
+ * @nr_threads: the number of threads to write with.
+ *
+ * The block layer is free to reorder writes between two flushes, so there is
+ * no need to write them one at a time either.  With more than one thread the
+ * queued writes of a flush epoch are split up into runs that don't overlap
+ * each other, and the runs are written in parallel.  Writes that overlap an
+ * earlier queued write still go out after it, as do flush, fua and discard
+ * entries.
+ */
+int log_set_threads(struct log *log, int nr_threads)
+{
+	struct log_pool *pool;
+	int ret;
+
+	log_stop_threads(log);
+	if (nr_threads <= 1)
+		return 0;
+
+	pool = calloc(1, sizeof(struct log_pool));
+	if (!pool)
+		goto out_nomem;
+	pool->threads = calloc(nr_threads, sizeof(pthread_t));
+	if (!pool->threads) {
+		free(pool);
+		goto out_nomem;
+	}
+	pthread_mutex_init(&pool->lock, NULL);
+	pthread_cond_init(&pool->work_cond, NULL);
+	pthread_cond_init(&pool->done_cond, NULL);
+	log->pool = pool;
+
+	for (pool->nr_threads = 0; pool->nr_threads < nr_threads;
+	     pool->nr_threads++) {
+		ret = pthread_create(&pool->threads[pool->nr_threads], NULL,
+				     log_pool_worker, log);
+		if (ret) {
+			fprintf(stderr, "Couldn't create replay thread: %d\n",
+				ret);
+			log_stop_threads(log);
+			return -1;
+		}
+	}
+	log->max_runs = LOG_MAX_RUNS;
+	return 0;
+
+out_nomem:
+	fprintf(stderr, "Couldn't allocate replay threads\n");
+	return -1;
+}
+
+/*
+ * @log: the log we are replaying.
+ *
+ * @return: 0 if all the queued writes made it to the replay device, -1 if
+ * there was an error.
+ *
+ * Write out everything log_queue_write() has batched up.
+ */
+int log_submit_writes(struct log *log)
+{
+	struct log_pool *pool = log->pool;
+	int ret = 0;
+	int i;
+
+	if (!log->nr_runs)
+		return 0;
+
+	if (!pool || log->nr_runs == 1) {
+		for (i = 0; i < log->nr_runs && !ret; i++)
+			ret = log_write_run(log, &log->runs[i]);
+	} else {
+		pthread_mutex_lock(&pool->lock);
+		pool->next_run = 0;
+		pool->error = 0;
+		pool->nr_busy = pool->nr_threads;
+		pool->generation++;
+		pthread_cond_broadcast(&pool->work_cond);
+		while (pool->nr_busy)
+			pthread_cond_wait(&pool->done_cond, &pool->lock);
+		ret = pool->error;
+		pthread_mutex_unlock(&pool->lock);
+	}
+
+	log->nr_iov = 0;
+	log->nr_runs = 0;
+	return ret;
+}
+
+/*
+ * @log: the log we are replaying.
+ * @buf: the data to write, must be in the log read buffer.
+ * @size: the size of the data.
+ * @offset: where the data goes on the replay device.
+ *
+ * Log entries are mostly small and follow each other on disk, so rather than
+ * doing a pwrite() per entry we queue them up and write runs of adjacent
+ * entries with one pwritev().  A write that overlaps anything still queued
+ * has to wait for it to be written, so we submit everything first.
+ */
+static int log_queue_write(struct log *log, char *buf, u64 size, u64 offset)
+{
+	struct log_run *run = NULL;
+	int submit = log->nr_iov == LOG_MAX_IOVS;
+	int i;
+
+	if (log->nr_runs) {
+		run = &log->runs[log->nr_runs - 1];
+		if (run->start + run->len != offset)
+			run = NULL;
+	}
+	if (!run && log->nr_runs == log->max_runs)
+		submit = 1;
+	for (i = 0; i < log->nr_runs && !submit; i++) {
+		if (offset < log->runs[i].start + log->runs[i].len &&
+		    log->runs[i].start < offset + size)
+			submit = 1;
+	}
+
+	if (submit) {
+		if (log_submit_writes(log))
+			return -1;
+		run = NULL;
+	}
+
+	if (!run) {
+		run = &log->runs[log->nr_runs++];
+		run->start = offset;
+		run->len = 0;
+		run->first_iov = log->nr_iov;
+		run->nr_iov = 0;
+	}
+	log->iov[log->nr_iov].iov_base = buf;
+	log->iov[log->nr_iov].iov_len = size;
+	log->nr_iov++;
+	run->nr_iov++;
+	run->len += size;
+	return 0;
+}
+
 /*
  * @log: the log we are replaying.
  * @entry: where we put the entry.
@@ -223,7 +550,10 @@ int log_entry_valid(struct log_write_entry *entry)
  *
  * @return: 0 if we replayed, 1 if we are at the end, -1 if there was an error.
  *
- * Replay the next entry in our log onto the replay device.
+ * Replay the next entry in our log onto the replay device.  Writes may be
+ * queued up rather than written right away, they are always submitted before
+ * a discard and at flush and fua entries.  Call log_submit_writes() before
+ * looking at the replay device.
  */
 int log_replay_next_entry(struct log *log, struct log_write_entry *entry,
 			  int read_data)
@@ -234,37 +564,28 @@ int log_replay_next_entry(struct log *log, struct log_write_entry *entry,
 		sizeof(struct log_write_entry);
 	char *buf;
 	char flags_buf[LOG_FLAGS_BUF_SIZE];
-	ssize_t ret;
-	off_t offset;
+	u64 offset;
 	int skip = 0;
+	int ret;
 
 	if (log->cur_entry >= log->nr_entries)
 		return 1;
 
-	ret = read(log->logfd, entry, read_size);
-	if (ret != read_size) {
+	buf = log_read(log, log->cur_pos, read_size, log->rbuf_size);
+	if (!buf) {
 		fprintf(stderr, "Error reading entry: %d\n", errno);
 		return -1;
 	}
+	memcpy(entry, buf, read_size);
 	if (!log_entry_valid(entry)) {
 		fprintf(stderr, "Malformed entry @%llu\n",
 				log->cur_pos / log->sectorsize);
 		return -1;
 	}
 	log->cur_entry++;
+	log->cur_pos += log->sectorsize;
 
 	size = le64_to_cpu(entry->nr_sectors) * log->sectorsize;
-	if (read_size < log->sectorsize) {
-		log->cur_pos = lseek(log->logfd,
-			log->sectorsize - sizeof(struct log_write_entry), SEEK_CUR);
-		if (log->cur_pos == (off_t)-1) {
-			fprintf(stderr, "Error seeking in log: %d\n", errno);
-			return -1;
-		}
-	} else {
-		log->cur_pos += read_size;
-	}
-
 	flags = le64_to_cpu(entry->flags);
 	entry_flags_to_str(flags, flags_buf);
 	skip = log_should_skip(log, entry);
@@ -277,42 +598,33 @@ int log_replay_next_entry(struct log *log, struct log_write_entry *entry,
 		       (unsigned long long)flags, flags_buf);
 	}
 	if (!size)
-		return 0;
+		goto out;
 
-	if (flags & LOG_DISCARD_FLAG)
+	if (flags & LOG_DISCARD_FLAG) {
+		if (log_submit_writes(log))
+			return -1;
 		return log_discard(log, entry);
+	}
 
 	if (skip) {
-		log->cur_pos = lseek(log->logfd, size, SEEK_CUR);
-		if (log->cur_pos == (off_t)-1) {
-			fprintf(stderr, "Error seeking in log: %d\n", errno);
-			return -1;
-		}
-		return 0;
+		log->cur_pos += size;
+		goto out;
 	}
 
-	buf = malloc(size);
+	buf = log_read(log, log->cur_pos, size, log->rbuf_size);
 	if (!buf) {
-		fprintf(stderr, "Error allocating buffer %llu entry %llu\n", (unsigned long long)size, (unsigned long long)log->cur_entry - 1);
-		return -1;
-	}
-
-	ret = read(log->logfd, buf, size);
-	if (ret != size) {
 		fprintf(stderr, "Error reading data: %d\n", errno);
-		free(buf);
 		return -1;
 	}
 	log->cur_pos += size;
 
 	offset = le64_to_cpu(entry->sector) * log->sectorsize;
-	ret = pwrite(log->replayfd, buf, size, offset);
-	free(buf);
-	if (ret != size) {
-		fprintf(stderr, "Error writing data: %d\n", errno);
-		return -1;
-	}
-
+	ret = log_queue_write(log, buf, size, offset);
+	if (ret)
+		return ret;
+out:
+	if (flags & (LOG_FLUSH_FLAG | LOG_FUA_FLAG))
+		return log_submit_writes(log);
 	return 0;
 }
 
@@ -332,25 +644,29 @@ int log_seek_entry(struct log *log, u64 entry_num)
 		return -1;
 	}
 
-	/* Skip the first sector containing the log super block */
-	log->cur_pos = lseek(log->logfd, log->sectorsize, SEEK_SET);
-	if (log->cur_pos == (off_t)-1) {
-		fprintf(stderr, "Error seeking in file: %d\n", errno);
-		return -1;
+	/* With an index we know exactly where the entry starts */
+	if (log->index) {
+		log->cur_pos = log->index->entries[entry_num].pos;
+		log->cur_entry = entry_num;
+		return 0;
 	}
 
+	/* Skip the first sector containing the log super block */
+	log->cur_pos = log->sectorsize;
+
 	log->cur_entry = 0;
 	for (i = 0; i < entry_num; i++) {
 		struct log_write_entry entry;
-		ssize_t ret;
+		char *buf;
 		off_t seek_size;
 		u64 flags;
 
-		ret = read(log->logfd, &entry, sizeof(entry));
-		if (ret != sizeof(entry)) {
+		buf = log_read(log, log->cur_pos, sizeof(entry), sizeof(entry));
+		if (!buf) {
 			fprintf(stderr, "Error reading entry: %d\n", errno);
 			return -1;
 		}
+		memcpy(&entry, buf, sizeof(entry));
 		if (!log_entry_valid(&entry)) {
 			fprintf(stderr, "Malformed entry @%llu\n",
 					log->cur_pos / log->sectorsize);
@@ -363,15 +679,11 @@ int log_seek_entry(struct log *log, u64 entry_num)
 			       (unsigned long long)le64_to_cpu(entry.nr_sectors),
 			       (unsigned long long)le64_to_cpu(entry.flags));
 		flags = le64_to_cpu(entry.flags);
-		seek_size = log->sectorsize - sizeof(entry);
+		seek_size = log->sectorsize;
 		if (!(flags & LOG_DISCARD_FLAG))
 			seek_size += le64_to_cpu(entry.nr_sectors) *
 				log->sectorsize;
-		log->cur_pos = lseek(log->logfd, seek_size, SEEK_CUR);
-		if (log->cur_pos == (off_t)-1) {
-			fprintf(stderr, "Error seeking in file: %d\n", errno);
-			return -1;
-		}
+		log->cur_pos += seek_size;
 		log->cur_entry++;
 	}
 
@@ -396,33 +708,25 @@ int log_seek_next_entry(struct log *log, struct log_write_entry *entry,
 		sizeof(struct log_write_entry);
 	u64 flags;
 	char flags_buf[LOG_FLAGS_BUF_SIZE];
-	ssize_t ret;
+	char *buf;
 
 	if (log->cur_entry >= log->nr_entries)
 		return 1;
 
-	ret = read(log->logfd, entry, read_size);
-	if (ret != read_size) {
+	buf = log_read(log, log->cur_pos, read_size, read_size);
+	if (!buf) {
 		fprintf(stderr, "Error reading entry: %d\n", errno);
 		return -1;
 	}
+	memcpy(entry, buf, read_size);
 	if (!log_entry_valid(entry)) {
 		fprintf(stderr, "Malformed entry @%llu\n",
 				log->cur_pos / log->sectorsize);
 		return -1;
 	}
 	log->cur_entry++;
+	log->cur_pos += log->sectorsize;
 
-	if (read_size < log->sectorsize) {
-		log->cur_pos = lseek(log->logfd,
-			log->sectorsize - sizeof(struct log_write_entry), SEEK_CUR);
-		if (log->cur_pos == (off_t)-1) {
-			fprintf(stderr, "Error seeking in log: %d\n", errno);
-			return -1;
-		}
-	} else {
-		log->cur_pos += read_size;
-	}
 	flags = le64_to_cpu(entry->flags);
 	entry_flags_to_str(flags, flags_buf);
 	if (log_writes_verbose > 1)
@@ -432,15 +736,9 @@ int log_seek_next_entry(struct log *log, struct log_write_entry *entry,
 		       (unsigned long long)le64_to_cpu(entry->nr_sectors),
 		       (unsigned long long)flags, flags_buf);
 
-	read_size = le64_to_cpu(entry->nr_sectors) * log->sectorsize;
-	if (!read_size || (flags & LOG_DISCARD_FLAG))
-		return 0;
-
-	log->cur_pos = lseek(log->logfd, read_size, SEEK_CUR);
-	if (log->cur_pos == (off_t)-1) {
-		fprintf(stderr, "Error seeking in log: %d\n", errno);
-		return -1;
-	}
+	if (!(flags & LOG_DISCARD_FLAG))
+		log->cur_pos += le64_to_cpu(entry->nr_sectors) *
+			log->sectorsize;
 
 	return 0;
 }
@@ -457,7 +755,7 @@ struct log *log_open(char *logfile, char *replayfile)
 	struct log_write_super super;
 	ssize_t ret;
 
-	log = malloc(sizeof(struct log));
+	log = calloc(1, sizeof(struct log));
 	if (!log) {
 		fprintf(stderr, "Couldn't alloc log\n");
 		return NULL;
@@ -481,6 +779,12 @@ struct log *log_open(char *logfile, char *replayfile)
 			log_free(log);
 			return NULL;
 		}
+		log->replayfile = strdup(replayfile);
+		if (!log->replayfile) {
+			fprintf(stderr, "Couldn't alloc log\n");
+			log_free(log);
+			return NULL;
+		}
 	}
 
 	ret = read(log->logfd, &super, sizeof(struct log_write_super));
@@ -507,13 +811,525 @@ struct log *log_open(char *logfile, char *replayfile)
 	log->nr_entries = le64_to_cpu(super.nr_entries);
 	log->max_zero_size = 128 * 1024 * 1024;
 
-	log->cur_pos = lseek(log->logfd, log->sectorsize - sizeof(super), SEEK_CUR);
-	if (log->cur_pos == (off_t) -1) {
-		fprintf(stderr, "Error seeking to first entry: %d\n", errno);
+	log->rbuf_size = LOG_READ_BUF_SIZE;
+	log->rbuf = malloc(log->rbuf_size);
+	log->iov = calloc(LOG_MAX_IOVS, sizeof(struct iovec));
+	log->runs = calloc(LOG_MAX_RUNS, sizeof(struct log_run));
+	log->max_runs = 1;
+	if (!log->rbuf || !log->iov || !log->runs) {
+		fprintf(stderr, "Couldn't allocate replay buffers\n");
 		log_free(log);
 		return NULL;
 	}
+
+	/* Skip the first sector containing the log super block */
+	log->cur_pos = log->sectorsize;
 	log->cur_entry = 0;
 
 	return log;
 }
+
+static int get_dev_size(int fd, u64 *size)
+{
+	struct stat st;
+
+	if (fstat(fd, &st))
+		return -1;
+	if (S_ISBLK(st.st_mode))
+		return ioctl(fd, BLKGETSIZE64, size);
+	*size = st.st_size;
+	return 0;
+}
+
+static int is_zero(char *buf, size_t len)
+{
+	return !buf[0] && !memcmp(buf, buf + 1, len - 1);
+}
+
+/*
+ * Make @dstfd a copy of the first @size bytes of @srcfd.  Regular files get
+ * reflinked if the filesystem can do it, otherwise the data is copied, leaving
+ * holes for zeroed blocks if @dstfd is a regular file we just truncated.
+ */
+static int copy_dev(int srcfd, int dstfd, u64 size)
+{
+	struct stat st;
+	char *buf;
+	u64 pos = 0;
+	int sparse;
+	int ret = -1;
+
+	if (fstat(dstfd, &st))
+		goto out_err;
+	sparse = S_ISREG(st.st_mode);
+	if (sparse && (ftruncate(dstfd, 0) || ftruncate(dstfd, size)))
+		goto out_err;
+#ifdef FICLONE
+	if (sparse && !ioctl(dstfd, FICLONE, srcfd))
+		return 0;
+#endif
+
+	buf = malloc(LOG_ZERO_BUF_SIZE);
+	if (!buf) {
+		fprintf(stderr, "Couldn't allocate copy buffer\n");
+		return -1;
+	}
+	while (pos < size) {
+		size_t len = size - pos > LOG_ZERO_BUF_SIZE ?
+			LOG_ZERO_BUF_SIZE : size - pos;
+		ssize_t done;
+
+		done = pread(srcfd, buf, len, pos);
+		if (done <= 0)
+			goto out_free;
+		if (!sparse || !is_zero(buf, done)) {
+			if (pwrite(dstfd, buf, done, pos) != done)
+				goto out_free;
+		}
+		pos += done;
+	}
+	ret = 0;
+out_free:
+	free(buf);
+	if (!ret)
+		return 0;
+out_err:
+	fprintf(stderr, "Error copying replay device: %d\n", errno);
+	return -1;
+}
+
+/*
+ * @log: the log we are replaying.
+ * @snapfile: the file or device to copy the replay device to.
+ *
+ * @return: 0 if we made the copy, -1 if there was an error.
+ *
+ * Copy the current state of the replay device to @snapfile, so that a checker
+ * can look at (and modify) that state while the replay device stays exactly as
+ * the log left it.  Replay can then simply carry on from where it is instead
+ * of starting over from the first entry.  When replaying onto a file on a
+ * filesystem with reflink support the copy is a cheap clone.
+ */
+int log_snapshot(struct log *log, char *snapfile)
+{
+	u64 size;
+	int srcfd, dstfd;
+	int ret;
+
+	if (log_submit_writes(log))
+		return -1;
+
+	srcfd = open(log->replayfile, O_RDONLY);
+	if (srcfd < 0) {
+		fprintf(stderr, "Couldn't open replay file %s: %d\n",
+			log->replayfile, errno);
+		return -1;
+	}
+	dstfd = open(snapfile, O_RDWR | O_CREAT, 0644);
+	if (dstfd < 0) {
+		fprintf(stderr, "Couldn't open snapshot %s: %d\n", snapfile,
+			errno);
+		close(srcfd);
+		return -1;
+	}
+
+	ret = get_dev_size(srcfd, &size);
+	if (ret)
+		fprintf(stderr, "Couldn't get replay device size: %d\n", errno);
+	else
+		ret = copy_dev(srcfd, dstfd, size);
+	if (!ret && fsync(dstfd)) {
+		fprintf(stderr, "Error syncing snapshot %s: %d\n", snapfile,
+			errno);
+		ret = -1;
+	}
+	close(dstfd);
+	close(srcfd);
+	return ret;
+}
+
+/*
+ * @log: the log we are replaying.
+ * @snapfile: a copy of the replay device made by log_snapshot().
+ *
+ * @return: 0 if we restored the replay device, -1 if there was an error.
+ *
+ * Put the replay device back into the state saved in @snapfile.  Anything
+ * still queued is thrown away, the caller has to seek the log back to the
+ * entry the snapshot was taken at.
+ */
+int log_restore_snapshot(struct log *log, char *snapfile)
+{
+	u64 size;
+	int srcfd;
+	int ret;
+
+	log->nr_iov = 0;
+	log->nr_runs = 0;
+
+	srcfd = open(snapfile, O_RDONLY);
+	if (srcfd < 0) {
+		fprintf(stderr, "Couldn't open snapshot %s: %d\n", snapfile,
+			errno);
+		return -1;
+	}
+
+	ret = get_dev_size(log->replayfd, &size);
+	if (ret)
+		fprintf(stderr, "Couldn't get replay device size: %d\n", errno);
+	else
+		ret = copy_dev(srcfd, log->replayfd, size);
+	close(srcfd);
+	return ret;
+}
+
+/*
+ * @log: the log we are replaying, must have an index.
+ * @entry_num: the entry whose data we want.
+ * @fd: the file or device to write the data to.
+ *
+ * @return: 0 if we wrote the data, -1 if there was an error.
+ *
+ * Write the data of a single entry to @fd without touching the replay device
+ * or the current position in the log.  This is for building crash images out
+ * of a subset of the logged writes.
+ */
+int log_write_entry_data(struct log *log, u64 entry_num, int fd)
+{
+	struct log_index_entry *ie = &log->index->entries[entry_num];
+	u64 size = ie->nr_sectors * log->sectorsize;
+	char *buf;
+
+	if (!size || (ie->flags & LOG_DISCARD_FLAG))
+		return 0;
+
+	buf = log_read(log, ie->pos + log->sectorsize, size, log->rbuf_size);
+	if (!buf) {
+		fprintf(stderr, "Error reading data: %d\n", errno);
+		return -1;
+	}
+	if (pwrite(fd, buf, size, ie->sector * log->sectorsize) != size) {
+		fprintf(stderr, "Error writing data: %d\n", errno);
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * @log: the log we are indexing.
+ *
+ * Walk the whole log once and record where every entry lives, along with the
+ * names of all the marks.  Once this is done log_seek_entry() and
+ * log_index_find() no longer need to read through the log.  The log is left
+ * positioned at the first entry.
+ */
+int log_build_index(struct log *log)
+{
+	struct log_write_entry *entry;
+	struct log_index *index;
+	u64 max_mark_len = log->sectorsize -
+		offsetof(struct log_write_entry, data);
+	u64 i;
+	int ret;
+
+	log_free_index(log->index);
+	log->index = NULL;
+
+	index = calloc(1, sizeof(struct log_index));
+	entry = malloc(log->sectorsize);
+	if (!index || !entry)
+		goto out_nomem;
+	index->entries = calloc(log->nr_entries + 1,
+				sizeof(struct log_index_entry));
+	if (!index->entries)
+		goto out_nomem;
+
+	if (log->nr_entries && log_seek_entry(log, 0))
+		goto out;
+
+	for (i = 0; i < log->nr_entries; i++) {
+		struct log_index_entry *ie = &index->entries[i];
+		struct log_index_mark *marks;
+		u64 len;
+
+		ie->pos = log->cur_pos;
+		ret = log_seek_next_entry(log, entry, 1);
+		if (ret) {
+			if (ret > 0)
+				fprintf(stderr, "Log ended early at entry "
+					"%llu\n", (unsigned long long)i);
+			goto out;
+		}
+		ie->sector = le64_to_cpu(entry->sector);
+		ie->nr_sectors = le64_to_cpu(entry->nr_sectors);
+		ie->flags = le64_to_cpu(entry->flags);
+		if (!(ie->flags & LOG_MARK_FLAG))
+			continue;
+
+		marks = realloc(index->marks, (index->nr_marks + 1) *
+				sizeof(struct log_index_mark));
+		if (!marks)
+			goto out_nomem;
+		index->marks = marks;
+		len = le64_to_cpu(entry->data_len);
+		if (len > max_mark_len)
+			len = max_mark_len;
+		marks[index->nr_marks].entry = i;
+		marks[index->nr_marks].name = strndup(entry->data, len);
+		if (!marks[index->nr_marks].name)
+			goto out_nomem;
+		index->nr_marks++;
+	}
+	free(entry);
+
+	index->nr_entries = log->nr_entries;
+	log->index = index;
+	if (!log->nr_entries)
+		return 0;
+	return log_seek_entry(log, 0);
+
+out_nomem:
+	fprintf(stderr, "Couldn't allocate log index\n");
+out:
+	log_free_index(index);
+	free(entry);
+	return -1;
+}
+
+static const char *log_index_mark_name(struct log_index *index, u64 entry_num)
+{
+	u64 lo = 0, hi = index->nr_marks;
+
+	while (lo < hi) {
+		u64 mid = lo + (hi - lo) / 2;
+
+		if (index->marks[mid].entry == entry_num)
+			return index->marks[mid].name;
+		if (index->marks[mid].entry < entry_num)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return NULL;
+}
+
+/*
+ * @log: the log we are searching, must have an index.
+ * @start: the first entry to look at.
+ * @stop_flags: the entry flags we are looking for.
+ * @mark: if LOG_MARK_FLAG is in @stop_flags, the mark we are looking for.
+ * @entry_num: where we put the entry number we found.
+ *
+ * @return: 0 if we found an entry, 1 if there is no such entry.
+ *
+ * Find the first entry at or after @start that matches @stop_flags, using the
+ * same rules as replay-log does when walking the log.
+ */
+int log_index_find(struct log *log, u64 start, u64 stop_flags, char *mark,
+		   u64 *entry_num)
+{
+	struct log_index *index = log->index;
+	u64 i;
+
+	for (i = start; i < index->nr_entries; i++) {
+		u64 flags = index->entries[i].flags;
+		const char *name;
+
+		if (!(flags & stop_flags))
+			continue;
+		if (!(stop_flags & LOG_MARK_FLAG)) {
+			*entry_num = i;
+			return 0;
+		}
+		if (!(flags & LOG_MARK_FLAG))
+			continue;
+		name = log_index_mark_name(index, i);
+		if (name && !strcmp(name, mark)) {
+			*entry_num = i;
+			return 0;
+		}
+	}
+	return 1;
+}
+
+/*
+ * Make sure an entry recorded in the index matches what is in the log, so we
+ * don't use a stale index for a log that was overwritten by a later run.
+ */
+static int log_index_entry_matches(struct log *log,
+				   struct log_index_entry *ie)
+{
+	struct log_write_entry entry;
+	ssize_t ret;
+
+	ret = pread(log->logfd, &entry, sizeof(entry), ie->pos);
+	if (ret != sizeof(entry))
+		return 0;
+	return le64_to_cpu(entry.sector) == ie->sector &&
+		le64_to_cpu(entry.nr_sectors) == ie->nr_sectors &&
+		le64_to_cpu(entry.flags) == ie->flags;
+}
+
+/*
+ * @log: the log the index belongs to.
+ * @indexfile: the index file written by log_save_index().
+ *
+ * @return: 0 if the index was loaded, 1 if there is no usable index in
+ * @indexfile, -1 if there was an error.
+ *
+ * Load a previously saved index for this log.  An index that doesn't match
+ * the log is treated the same as a missing one so the caller can rebuild it.
+ */
+int log_load_index(struct log *log, char *indexfile)
+{
+	struct log_index_super super;
+	struct log_index_disk_entry de;
+	struct log_index *index;
+	FILE *fp;
+	u64 i;
+	int ret = 1;
+
+	fp = fopen(indexfile, "r");
+	if (!fp) {
+		if (errno == ENOENT)
+			return 1;
+		fprintf(stderr, "Couldn't open index %s: %d\n", indexfile,
+			errno);
+		return -1;
+	}
+
+	if (fread(&super, sizeof(super), 1, fp) != 1 ||
+	    le64_to_cpu(super.magic) != LOG_INDEX_MAGIC ||
+	    le64_to_cpu(super.version) != LOG_INDEX_VERSION ||
+	    le64_to_cpu(super.nr_entries) != log->nr_entries ||
+	    le64_to_cpu(super.sectorsize) != log->sectorsize) {
+		fclose(fp);
+		return 1;
+	}
+
+	index = calloc(1, sizeof(struct log_index));
+	if (!index)
+		goto out_nomem;
+	index->entries = calloc(log->nr_entries + 1,
+				sizeof(struct log_index_entry));
+	index->marks = calloc(le64_to_cpu(super.nr_marks) + 1,
+			      sizeof(struct log_index_mark));
+	if (!index->entries || !index->marks)
+		goto out_nomem;
+
+	for (i = 0; i < log->nr_entries; i++) {
+		if (fread(&de, sizeof(de), 1, fp) != 1)
+			goto out;
+		index->entries[i].pos = le64_to_cpu(de.pos);
+		index->entries[i].sector = le64_to_cpu(de.sector);
+		index->entries[i].nr_sectors = le64_to_cpu(de.nr_sectors);
+		index->entries[i].flags = le64_to_cpu(de.flags);
+	}
+	index->nr_entries = log->nr_entries;
+
+	for (i = 0; i < le64_to_cpu(super.nr_marks); i++) {
+		struct log_index_mark *mark = &index->marks[i];
+		__le64 val[2];
+		u64 len;
+
+		if (fread(val, sizeof(val), 1, fp) != 1)
+			goto out;
+		mark->entry = le64_to_cpu(val[0]);
+		len = le64_to_cpu(val[1]);
+		if (mark->entry >= log->nr_entries || len >= log->sectorsize)
+			goto out;
+		mark->name = calloc(1, len + 1);
+		if (!mark->name)
+			goto out_nomem;
+		index->nr_marks++;
+		if (len && fread(mark->name, len, 1, fp) != 1)
+			goto out;
+	}
+
+	if (log->nr_entries &&
+	    (!log_index_entry_matches(log, &index->entries[0]) ||
+	     !log_index_entry_matches(log,
+			&index->entries[log->nr_entries / 2]) ||
+	     !log_index_entry_matches(log,
+			&index->entries[log->nr_entries - 1])))
+		goto out;
+
+	fclose(fp);
+	log_free_index(log->index);
+	log->index = index;
+	return 0;
+
+out_nomem:
+	fprintf(stderr, "Couldn't allocate log index\n");
+	ret = -1;
+out:
+	if (ret > 0 && log_writes_verbose)
+		printf("ignoring stale index %s\n", indexfile);
+	log_free_index(index);
+	fclose(fp);
+	return ret;
+}
+
+/*
+ * @log: the log whose index we are saving, must have an index.
+ * @indexfile: where to save the index.
+ *
+ * Save the index so later runs against the same log can skip the walk in
+ * log_build_index().
+ */
+int log_save_index(struct log *log, char *indexfile)
+{
+	struct log_index *index = log->index;
+	struct log_index_super super;
+	struct log_index_disk_entry de;
+	FILE *fp;
+	u64 i;
+
+	fp = fopen(indexfile, "w");
+	if (!fp) {
+		fprintf(stderr, "Couldn't create index %s: %d\n", indexfile,
+			errno);
+		return -1;
+	}
+
+	memset(&super, 0, sizeof(super));
+	super.magic = cpu_to_le64(LOG_INDEX_MAGIC);
+	super.version = cpu_to_le64(LOG_INDEX_VERSION);
+	super.nr_entries = cpu_to_le64(index->nr_entries);
+	super.sectorsize = cpu_to_le64(log->sectorsize);
+	super.nr_marks = cpu_to_le64(index->nr_marks);
+	if (fwrite(&super, sizeof(super), 1, fp) != 1)
+		goto out;
+
+	for (i = 0; i < index->nr_entries; i++) {
+		de.pos = cpu_to_le64(index->entries[i].pos);
+		de.sector = cpu_to_le64(index->entries[i].sector);
+		de.nr_sectors = cpu_to_le64(index->entries[i].nr_sectors);
+		de.flags = cpu_to_le64(index->entries[i].flags);
+		if (fwrite(&de, sizeof(de), 1, fp) != 1)
+			goto out;
+	}
+
+	for (i = 0; i < index->nr_marks; i++) {
+		u64 len = strlen(index->marks[i].name);
+		__le64 val[2];
+
+		val[0] = cpu_to_le64(index->marks[i].entry);
+		val[1] = cpu_to_le64(len);
+		if (fwrite(val, sizeof(val), 1, fp) != 1 ||
+		    (len && fwrite(index->marks[i].name, len, 1, fp) != 1))
+			goto out;
+	}
+
+	if (fclose(fp)) {
+		fp = NULL;
+		goto out;
+	}
+	return 0;
+out:
+	fprintf(stderr, "Error writing index %s: %d\n", indexfile, errno);
+	if (fp)
+		fclose(fp);
+	unlink(indexfile);
+	return -1;
+}
@@ -4,6 +4,7 @@
 
 #include <linux/types.h>
 #include <endian.h>
+#include <sys/uio.h>
 #if __BYTE_ORDER == __LITTLE_ENDIAN
 #include <linux/byteorder/little_endian.h>
 #else
@@ -14,6 +15,7 @@ extern int log_writes_verbose;
 
 #define le64_to_cpu __le64_to_cpu
 #define le32_to_cpu __le32_to_cpu
+#define cpu_to_le64 __cpu_to_le64
 
 typedef __u64 u64;
 typedef __u32 u32;
@@ -61,12 +63,83 @@ struct log_write_entry {
 	char data[1];
 };
 
+/*
+ * On-disk format of the replay-log index file.  The index lets us seek
+ * straight to an entry, a mark or the next flush/fua instead of walking the
+ * log from the start every time.  Everything is little endian; the fixed size
+ * header is followed by nr_entries log_index_disk_entry structs and then by
+ * nr_marks (entry number, name length, name) records.
+ */
+#define LOG_INDEX_MAGIC 0x78646e69676f6c72ULL
+#define LOG_INDEX_VERSION 1
+
+struct log_index_super {
+	__le64 magic;
+	__le64 version;
+	__le64 nr_entries;
+	__le64 sectorsize;
+	__le64 nr_marks;
+};
+
+struct log_index_disk_entry {
+	__le64 pos;
+	__le64 sector;
+	__le64 nr_sectors;
+	__le64 flags;
+};
+
+/*
+ * pos - byte offset of the entry header in the log.
+ * sector, nr_sectors, flags - copied from the log entry.
+ */
+struct log_index_entry {
+	u64 pos;
+	u64 sector;
+	u64 nr_sectors;
+	u64 flags;
+};
+
+struct log_index_mark {
+	u64 entry;
+	char *name;
+};
+
+struct log_index {
+	u64 nr_entries;
+	u64 nr_marks;
+	struct log_index_entry *entries;
+	struct log_index_mark *marks;
+};
+
 #define LOG_IGNORE_DISCARD (1 << 0)
 #define LOG_DISCARD_NOT_SUPP (1 << 1)
 
+/*
+ * Size of the window of the log we read in one go, the most writes we batch
+ * into one pwritev() and the size of the buffer used to zero discarded ranges.
+ */
+#define LOG_READ_BUF_SIZE (8 * 1024 * 1024)
+#define LOG_MAX_IOVS 1024
+#define LOG_MAX_RUNS 256
+#define LOG_ZERO_BUF_SIZE (1024 * 1024)
+
+/*
+ * A run of queued writes that are adjacent on the replay device, written with
+ * one pwritev() of iovs first_iov to first_iov + nr_iov - 1.
+ */
+struct log_run {
+	u64 start;
+	u64 len;
+	int first_iov;
+	int nr_iov;
+};
+
+struct log_pool;
+
 struct log {
 	int logfd;
 	int replayfd;
+	char *replayfile;
 	unsigned long flags;
 	u64 sectorsize;
 	u64 start_sector;
@@ -75,14 +148,41 @@ struct log {
 	u64 cur_entry;
 	u64 max_zero_size;
 	off_t cur_pos;
+	struct log_index *index;
+
+	/* window of the log, see log_read() */
+	char *rbuf;
+	size_t rbuf_size;
+	off_t rbuf_start;
+	size_t rbuf_len;
+
+	/* writes waiting for log_submit_writes() */
+	struct iovec *iov;
+	int nr_iov;
+	struct log_run *runs;
+	int nr_runs;
+	int max_runs;
+	struct log_pool *pool;
+
+	char *zero_buf;
 };
 
 struct log *log_open(char *logfile, char *replayfile);
 int log_replay_next_entry(struct log *log, struct log_write_entry *entry,
 			  int read_data);
+int log_snapshot(struct log *log, char *snapfile);
+int log_restore_snapshot(struct log *log, char *snapfile);
+int log_write_entry_data(struct log *log, u64 entry_num, int fd);
+int log_set_threads(struct log *log, int nr_threads);
+int log_submit_writes(struct log *log);
 int log_seek_entry(struct log *log, u64 entry_num);
 int log_seek_next_entry(struct log *log, struct log_write_entry *entry,
 			int read_data);
 void log_free(struct log *log);
+int log_build_index(struct log *log);
+int log_load_index(struct log *log, char *indexfile);
+int log_save_index(struct log *log, char *indexfile);
+int log_index_find(struct log *log, u64 start, u64 stop_flags, char *mark,
+		   u64 *entry_num);
 
 #endif
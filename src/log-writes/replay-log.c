@@ -4,6 +4,8 @@
 #include <getopt.h>
 #include <stdlib.h>
 #include <string.h>
+#include <fcntl.h>
+#include <errno.h>
 #include "log-writes.h"
 
 enum option_indexes {
@@ -23,6 +25,13 @@ enum option_indexes {
 	START_MARK,
 	START_SECTOR,
 	END_SECTOR,
+	INDEX,
+	THREADS,
+	SNAPSHOT,
+	BISECT,
+	CRASH_STATES,
+	CRASH_MAX,
+	SEED,
 };
 
 static struct option long_options[] = {
@@ -42,6 +51,13 @@ static struct option long_options[] = {
 	{"start-mark", required_argument, NULL, 0},
 	{"start-sector", required_argument, NULL, 0},
 	{"end-sector", required_argument, NULL, 0},
+	{"index", required_argument, NULL, 0},
+	{"threads", required_argument, NULL, 0},
+	{"snapshot", required_argument, NULL, 0},
+	{"bisect", required_argument, NULL, 0},
+	{"crash-states", required_argument, NULL, 0},
+	{"crash-max", required_argument, NULL, 0},
+	{"seed", required_argument, NULL, 0},
 	{ NULL, 0, NULL, 0 },
 };
 
@@ -64,12 +80,28 @@ static void usage(void)
 	fprintf(stderr, "\t--no-discard - don't process discard entries\n");
 	fprintf(stderr, "\t--fsck - the fsck command to run, must specify "
 		"--check\n");
-	fprintf(stderr, "\t--check [<number>|flush|fua|discard] when to check "
-		"the file system, mush specify --fsck\n");
+	fprintf(stderr, "\t--check [<number>|flush|fua|discard|mark] when to "
+		"check the file system, mush specify --fsck\n");
+	fprintf(stderr, "\t--snapshot <file> - copy the replay device to "
+		"<file> before running --fsck, fsck should check <file>\n");
+	fprintf(stderr, "\t--bisect <file> - find the first --check point "
+		"where --fsck fails, saving good states in <file>, must "
+		"specify --snapshot\n");
+	fprintf(stderr, "\t--crash-states <number> - run --fsck on this many "
+		"random crash states between each pair of flushes, must "
+		"specify --snapshot\n");
+	fprintf(stderr, "\t--crash-max <number> - stop after checking this "
+		"many crash states\n");
+	fprintf(stderr, "\t--seed <number> - random seed for "
+		"--crash-states\n");
 	fprintf(stderr, "\t--start-sector <sector> - replay ops on region "
 		"from <sector> onto <device>\n");
 	fprintf(stderr, "\t--end-sector <sector> - replay ops on region "
 		"to <sector> onto <device>\n");
+	fprintf(stderr, "\t--index <file> - use (and create if needed) an "
+		"index of the log for fast seeking\n");
+	fprintf(stderr, "\t--threads <number> - replay independent writes "
+		"between flushes with this many threads\n");
 	fprintf(stderr, "\t-v or --verbose - print replayed ops\n");
 	fprintf(stderr, "\t-vv - print also skipped ops\n");
 	exit(1);
@@ -100,9 +132,22 @@ static int should_stop(struct log_write_entry *entry, u64 stop_flags,
 	return 0;
 }
 
-static int run_fsck(struct log *log, char *fsck_command)
+/*
+ * If we were given a snapshot file the fsck command checks a copy of the
+ * replay device, so whatever it does to the file system doesn't affect the
+ * rest of the replay.
+ */
+static int run_fsck(struct log *log, char *fsck_command, char *snapfile)
 {
-	int ret = fsync(log->replayfd);
+	int ret;
+
+	if (snapfile)
+		ret = log_snapshot(log, snapfile);
+	else
+		ret = log_submit_writes(log);
+	if (ret)
+		return ret;
+	ret = fsync(log->replayfd);
 	if (ret)
 		return ret;
 	ret = system(fsck_command);
@@ -116,13 +161,27 @@ enum log_replay_check_mode {
 	CHECK_FUA = 2,
 	CHECK_FLUSH = 3,
 	CHECK_DISCARD = 4,
+	CHECK_MARK = 5,
 };
 
 static int seek_to_mark(struct log *log, struct log_write_entry *entry,
 			char *mark)
 {
+	u64 entry_num;
 	int ret;
 
+	if (log->index) {
+		if (log_index_find(log, log->cur_entry, LOG_MARK_FLAG, mark,
+				   &entry_num)) {
+			fprintf(stderr, "Couldn't find starting mark\n");
+			return -1;
+		}
+		ret = log_seek_entry(log, entry_num);
+		if (ret)
+			return ret;
+		return log_seek_next_entry(log, entry, 1);
+	}
+
 	while ((ret = log_seek_next_entry(log, entry, 1)) == 0) {
 		if (should_stop(entry, LOG_MARK_FLAG, mark))
 			break;
@@ -135,9 +194,311 @@ static int seek_to_mark(struct log *log, struct log_write_entry *entry,
 	return ret;
 }
 
+/*
+ * Find mode using the index, leaves the log in the same state as walking it
+ * with log_seek_next_entry() until the matching entry would.
+ */
+static int index_find_entry(struct log *log, struct log_write_entry *entry,
+			    u64 stop_flags, char *mark, u64 run_limit)
+{
+	u64 entry_num = log->nr_entries;
+	int ret;
+
+	log_index_find(log, log->cur_entry, stop_flags, mark, &entry_num);
+	if (run_limit && log->cur_entry + run_limit - 1 < entry_num)
+		entry_num = log->cur_entry + run_limit - 1;
+	if (entry_num >= log->nr_entries)
+		return 1;
+
+	ret = log_seek_entry(log, entry_num);
+	if (ret)
+		return ret;
+	return log_seek_next_entry(log, entry, 1);
+}
+
+/*
+ * The entry a plain replay from the current entry would stop after, given the
+ * stop flags, mark and --limit, or the last entry of the log.  The log must
+ * have an index.
+ */
+static u64 index_last_entry(struct log *log, u64 stop_flags, char *mark,
+			    u64 run_limit)
+{
+	u64 entry_num = log->nr_entries - 1;
+
+	if (stop_flags)
+		log_index_find(log, log->cur_entry, stop_flags, mark,
+			       &entry_num);
+	if (run_limit && log->cur_entry + run_limit - 1 < entry_num)
+		entry_num = log->cur_entry + run_limit - 1;
+	return entry_num;
+}
+
+/*
+ * Load the index for the log from @indexfile, or build it and save it there
+ * if it doesn't exist yet or belongs to a different log.
+ */
+static int setup_index(struct log *log, char *indexfile)
+{
+	int ret;
+
+	ret = log_load_index(log, indexfile);
+	if (ret <= 0)
+		return ret;
+	ret = log_build_index(log);
+	if (ret)
+		return ret;
+	return log_save_index(log, indexfile);
+}
+
+/*
+ * Is the entry we just read from the log one --check wants us to run fsck at?
+ * @num_entries is the number of entries we've gone through so far.
+ */
+static int is_check_point(enum log_replay_check_mode check_mode,
+			  u64 check_number, u64 num_entries, u64 flags)
+{
+	switch (check_mode) {
+	case CHECK_NUMBER:
+		return !(num_entries % check_number);
+	case CHECK_FUA:
+		return !!(flags & LOG_FUA_FLAG);
+	case CHECK_FLUSH:
+		return !!(flags & LOG_FLUSH_FLAG);
+	case CHECK_DISCARD:
+		return !!(flags & LOG_DISCARD_FLAG);
+	case CHECK_MARK:
+		return !!(flags & LOG_MARK_FLAG);
+	}
+	return 0;
+}
+
+/*
+ * Replay up to and including entry @last.
+ */
+static int replay_to_entry(struct log *log, struct log_write_entry *entry,
+			   u64 last)
+{
+	int ret;
+
+	while (log->cur_entry <= last) {
+		ret = log_replay_next_entry(log, entry, 1);
+		if (ret)
+			return ret < 0 ? ret : -1;
+	}
+	return 0;
+}
+
+/*
+ * Binary search for the first check point where fsck fails.  The replay
+ * device always holds the state at the last check point known to be good,
+ * and a copy of that state is kept in @goodfile.  Each step replays forward
+ * to the middle of the remaining range and checks a snapshot of it.  If fsck
+ * passes that becomes the new good state, otherwise we go back to the copy.
+ * That is log2(N) fsck runs for N check points, and about one pass over the
+ * log in total.
+ *
+ * Only check points up to and including entry @last are searched.  The log
+ * must have an index.
+ *
+ * @return: 0 if fsck passed at every check point, 1 if it failed somewhere,
+ * -1 if there was an error.
+ */
+static int bisect(struct log *log, struct log_write_entry *entry, u64 last,
+		  enum log_replay_check_mode check_mode, u64 check_number,
+		  char *fsck_command, char *snapfile, char *goodfile)
+{
+	u64 start = log->cur_entry;
+	u64 *points = NULL;
+	u64 nr_points = 0;
+	long long lo = -1, hi;
+	u64 i;
+	int ret;
+
+	points = malloc((last - start + 2) * sizeof(u64));
+	if (!points) {
+		fprintf(stderr, "Couldn't allocate memory\n");
+		return -1;
+	}
+	for (i = start; i <= last; i++) {
+		if (is_check_point(check_mode, check_number, i - start + 1,
+				   log->index->entries[i].flags))
+			points[nr_points++] = i;
+	}
+	hi = nr_points;
+
+	ret = log_snapshot(log, goodfile);
+	while (!ret && hi - lo > 1) {
+		long long mid = lo + (hi - lo) / 2;
+
+		ret = replay_to_entry(log, entry, points[mid]);
+		if (!ret)
+			ret = log_snapshot(log, snapfile);
+		if (ret)
+			break;
+		ret = run_fsck(log, fsck_command, NULL);
+		if (log_writes_verbose)
+			printf("fsck %s at entry %llu\n",
+			       ret ? "failed" : "passed",
+			       (unsigned long long)points[mid]);
+		if (!ret) {
+			lo = mid;
+			ret = log_snapshot(log, goodfile);
+			continue;
+		}
+
+		hi = mid;
+		ret = log_restore_snapshot(log, goodfile);
+		if (!ret)
+			ret = log_seek_entry(log, lo < 0 ? start :
+					     points[lo] + 1);
+	}
+
+	if (!ret && hi < nr_points) {
+		fprintf(stderr, "Fsck errored out on entry %llu\n",
+			(unsigned long long)points[hi]);
+		ret = 1;
+	}
+	free(points);
+	return ret;
+}
+
+static u64 crash_rand(u64 *state)
+{
+	/* xorshift64, we only need something cheap and reproducible */
+	*state ^= *state << 13;
+	*state ^= *state >> 7;
+	*state ^= *state << 17;
+	return *state;
+}
+
+struct crash_ctx {
+	char *fsck_command;
+	char *snapfile;
+	u64 nr_states;
+	u64 max_states;
+	u64 states_done;
+	u64 rand_state;
+	u64 *dropped;
+};
+
+/*
+ * Build and check crash images for one flush epoch.  The replay device holds
+ * the state at the start of the epoch and @writes are the writes logged since
+ * then.  A crash can happen after any number of those writes were issued, and
+ * any write that wasn't flushed yet may or may not have made it to disk,
+ * except for fua writes.  So each image is a random prefix of @writes with a
+ * random subset of the non-fua writes left out.
+ *
+ * @return: 0 if fsck passed on every image, 1 if it failed, -1 on error.
+ */
+static int check_crash_epoch(struct log *log, struct crash_ctx *ctx,
+			     u64 *writes, u64 nr_writes)
+{
+	u64 state, nr_issued, nr_dropped, i;
+	int fd;
+	int ret;
+
+	for (state = 0; nr_writes && state < ctx->nr_states; state++) {
+		if (ctx->max_states && ctx->states_done >= ctx->max_states)
+			break;
+		ctx->states_done++;
+
+		ret = log_snapshot(log, ctx->snapfile);
+		if (ret)
+			return -1;
+		fd = open(ctx->snapfile, O_WRONLY);
+		if (fd < 0) {
+			fprintf(stderr, "Couldn't open snapshot %s: %d\n",
+				ctx->snapfile, errno);
+			return -1;
+		}
+
+		nr_issued = 1 + crash_rand(&ctx->rand_state) % nr_writes;
+		nr_dropped = 0;
+		for (i = 0; i < nr_issued && !ret; i++) {
+			u64 flags = log->index->entries[writes[i]].flags;
+
+			if (!(flags & LOG_FUA_FLAG) &&
+			    (crash_rand(&ctx->rand_state) & 1)) {
+				ctx->dropped[nr_dropped++] = writes[i];
+				continue;
+			}
+			ret = log_write_entry_data(log, writes[i], fd);
+		}
+		if (!ret && fsync(fd)) {
+			fprintf(stderr, "Error syncing snapshot %s: %d\n",
+				ctx->snapfile, errno);
+			ret = -1;
+		}
+		close(fd);
+		if (ret)
+			return ret;
+
+		if (run_fsck(log, ctx->fsck_command, NULL)) {
+			fprintf(stderr, "Fsck errored out on crash state after "
+				"entry %llu, dropped entries:",
+				(unsigned long long)writes[nr_issued - 1]);
+			for (i = 0; i < nr_dropped; i++)
+				fprintf(stderr, " %llu",
+					(unsigned long long)ctx->dropped[i]);
+			fprintf(stderr, "\n");
+			return 1;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Replay the log up to and including entry @last one flush epoch at a time,
+ * checking crash images of every epoch with check_crash_epoch() before
+ * applying it to the replay device.  Discards are treated like flushes,
+ * replay-log always applies them in order.  The log must have an index.
+ */
+static int check_crash_states(struct log *log, struct log_write_entry *entry,
+			      u64 last, struct crash_ctx *ctx)
+{
+	u64 start = log->cur_entry;
+	u64 *writes;
+	u64 nr_writes = 0;
+	u64 i;
+	int ret = 0;
+
+	writes = malloc((log->nr_entries + 1) * sizeof(u64));
+	ctx->dropped = malloc((log->nr_entries + 1) * sizeof(u64));
+	if (!writes || !ctx->dropped) {
+		fprintf(stderr, "Couldn't allocate memory\n");
+		ret = -1;
+		goto out;
+	}
+
+	for (i = start; i <= last && !ret; i++) {
+		struct log_index_entry *ie = &log->index->entries[i];
+		int barrier = ie->flags & (LOG_FLUSH_FLAG | LOG_DISCARD_FLAG);
+
+		if (!barrier && ie->nr_sectors &&
+		    ie->sector + ie->nr_sectors > log->start_sector &&
+		    ie->sector <= log->end_sector)
+			writes[nr_writes++] = i;
+		/* the last entry ends the final epoch */
+		if (!barrier && i < last)
+			continue;
+
+		ret = check_crash_epoch(log, ctx, writes, nr_writes);
+		if (!ret)
+			ret = replay_to_entry(log, entry, i);
+		nr_writes = 0;
+	}
+out:
+	free(writes);
+	free(ctx->dropped);
+	return ret;
+}
+
 int main(int argc, char **argv)
 {
 	char *logfile = NULL, *replayfile = NULL, *fsck_command = NULL;
+	char *indexfile = NULL, *snapfile = NULL, *goodfile = NULL;
 	struct log_write_entry *entry;
 	u64 stop_flags = 0;
 	u64 start_entry = 0;
@@ -145,7 +506,11 @@ int main(int argc, char **argv)
 	u64 end_sector = -1ULL;
 	u64 run_limit = 0;
 	u64 num_entries = 0;
+	u64 last_entry = 0;
 	u64 check_number = 0;
+	u64 nr_threads = 1;
+	u64 seed = 0;
+	struct crash_ctx crash = { 0 };
 	char *end_mark = NULL, *start_mark = NULL;
 	char *tmp = NULL;
 	struct log *log;
@@ -256,6 +621,8 @@ int main(int argc, char **argv)
 				check_mode = CHECK_FUA;
 			} else if (!strcmp(optarg, "discard")) {
 				check_mode = CHECK_DISCARD;
+			} else if (!strcmp(optarg, "mark")) {
+				check_mode = CHECK_MARK;
 			} else {
 				check_mode = CHECK_NUMBER;
 				check_number = strtoull(optarg, &tmp, 0);
@@ -283,6 +650,60 @@ int main(int argc, char **argv)
 			}
 			tmp = NULL;
 			break;
+		case THREADS:
+			nr_threads = strtoull(optarg, &tmp, 0);
+			if (!nr_threads || nr_threads > 1024 ||
+			    (tmp && *tmp != '\0')) {
+				fprintf(stderr, "Invalid number of threads\n");
+				exit(1);
+			}
+			tmp = NULL;
+			break;
+		case SNAPSHOT:
+			snapfile = strdup(optarg);
+			if (!snapfile) {
+				fprintf(stderr, "Couldn't allocate memory\n");
+				exit(1);
+			}
+			break;
+		case BISECT:
+			goodfile = strdup(optarg);
+			if (!goodfile) {
+				fprintf(stderr, "Couldn't allocate memory\n");
+				exit(1);
+			}
+			break;
+		case CRASH_STATES:
+			crash.nr_states = strtoull(optarg, &tmp, 0);
+			if (!crash.nr_states || (tmp && *tmp != '\0')) {
+				fprintf(stderr, "Invalid number of states\n");
+				exit(1);
+			}
+			tmp = NULL;
+			break;
+		case CRASH_MAX:
+			crash.max_states = strtoull(optarg, &tmp, 0);
+			if (tmp && *tmp != '\0') {
+				fprintf(stderr, "Invalid number of states\n");
+				exit(1);
+			}
+			tmp = NULL;
+			break;
+		case SEED:
+			seed = strtoull(optarg, &tmp, 0);
+			if (tmp && *tmp != '\0') {
+				fprintf(stderr, "Invalid seed\n");
+				exit(1);
+			}
+			tmp = NULL;
+			break;
+		case INDEX:
+			indexfile = strdup(optarg);
+			if (!indexfile) {
+				fprintf(stderr, "Couldn't allocate memory\n");
+				exit(1);
+			}
+			break;
 		default:
 			usage();
 		}
@@ -297,6 +718,13 @@ int main(int argc, char **argv)
 	free(logfile);
 	free(replayfile);
 
+	if (indexfile) {
+		ret = setup_index(log, indexfile);
+		if (ret)
+			exit(1);
+		free(indexfile);
+	}
+
 	if (!discard)
 		log->flags |= LOG_IGNORE_DISCARD;
 
@@ -321,22 +749,32 @@ int main(int argc, char **argv)
 			exit(1);
 	}
 
-	if ((fsck_command && !check_mode) || (!fsck_command && check_mode))
+	if ((fsck_command && !check_mode && !crash.nr_states) ||
+	    (!fsck_command && (check_mode || crash.nr_states)) ||
+	    (snapfile && !fsck_command) || (goodfile && !snapfile) ||
+	    (crash.nr_states && (!snapfile || goodfile)))
 		usage();
 
 	/* We just want to find a given entry */
 	if (find_mode) {
-		while ((ret = log_seek_next_entry(log, entry, 1)) == 0) {
-			num_entries++;
-			if ((run_limit && num_entries == run_limit) ||
-			    should_stop(entry, stop_flags, end_mark)) {
-				printf("%llu@%llu\n",
-				       (unsigned long long)log->cur_entry - 1,
-				       log->cur_pos / log->sectorsize);
-				log_free(log);
-				return 0;
+		if (log->index) {
+			ret = index_find_entry(log, entry, stop_flags, end_mark,
+					       run_limit);
+		} else {
+			while ((ret = log_seek_next_entry(log, entry, 1)) == 0) {
+				num_entries++;
+				if ((run_limit && num_entries == run_limit) ||
+				    should_stop(entry, stop_flags, end_mark))
+					break;
 			}
 		}
+		if (!ret) {
+			printf("%llu@%llu\n",
+			       (unsigned long long)log->cur_entry - 1,
+			       log->cur_pos / log->sectorsize);
+			log_free(log);
+			return 0;
+		}
 		log_free(log);
 		if (ret < 0)
 			return ret;
@@ -360,21 +798,57 @@ int main(int argc, char **argv)
 		return 0;
 	}
 
+	if (log_set_threads(log, nr_threads))
+		exit(1);
+
+	/* both stop where a plain replay would */
+	if (goodfile || crash.nr_states) {
+		if (!log->nr_entries || log->cur_entry >= log->nr_entries) {
+			fprintf(stderr, "No entries to replay\n");
+			exit(1);
+		}
+		if (!log->index) {
+			u64 start = log->cur_entry;
+
+			if (log_build_index(log) || log_seek_entry(log, start))
+				exit(1);
+		}
+		last_entry = index_last_entry(log, stop_flags, end_mark,
+					      run_limit);
+	}
+
+	if (goodfile) {
+		ret = bisect(log, entry, last_entry, check_mode, check_number,
+			     fsck_command, snapfile, goodfile);
+		if (log_submit_writes(log))
+			ret = -1;
+		fsync(log->replayfd);
+		log_free(log);
+		exit(ret ? 1 : 0);
+	}
+
+	if (crash.nr_states) {
+		crash.fsck_command = fsck_command;
+		crash.snapfile = snapfile;
+		crash.rand_state = seed ^ 0x9e3779b97f4a7c15ULL;
+		ret = check_crash_states(log, entry, last_entry, &crash);
+		if (log_submit_writes(log))
+			ret = -1;
+		if (log_writes_verbose)
+			printf("checked %llu crash states\n",
+			       (unsigned long long)crash.states_done);
+		fsync(log->replayfd);
+		log_free(log);
+		exit(ret ? 1 : 0);
+	}
+
 	while ((ret = log_replay_next_entry(log, entry, 1)) == 0) {
 		num_entries++;
 		if (fsck_command) {
-			if ((check_mode == CHECK_NUMBER) &&
-			    !(num_entries % check_number))
-				ret = run_fsck(log, fsck_command);
-			else if ((check_mode == CHECK_FUA) &&
-				 should_stop(entry, LOG_FUA_FLAG, NULL))
-				ret = run_fsck(log, fsck_command);
-			else if ((check_mode == CHECK_FLUSH) &&
-				 should_stop(entry, LOG_FLUSH_FLAG, NULL))
-				ret = run_fsck(log, fsck_command);
-			else if ((check_mode == CHECK_DISCARD) &&
-				 should_stop(entry, LOG_DISCARD_FLAG, NULL))
-				ret = run_fsck(log, fsck_command);
+			if (is_check_point(check_mode, check_number,
+					   num_entries,
+					   le64_to_cpu(entry->flags)))
+				ret = run_fsck(log, fsck_command, snapfile);
 			else
 				ret = 0;
 			if (ret) {
@@ -389,9 +863,12 @@ int main(int argc, char **argv)
 		    should_stop(entry, stop_flags, end_mark))
 			break;
 	}
+	if (log_submit_writes(log))
+		ret = -1;
 	fsync(log->replayfd);
 	log_free(log);
 	free(end_mark);
+	free(snapfile);
 	if (ret < 0)
 		exit(1);
 	return 0;
@@ -7,12 +7,17 @@
 #include <sys/param.h>
 #include <sys/stat.h>
 #include <sys/time.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
 #include <fcntl.h>
 #include <stdio.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 #include <dirent.h>
+#include <signal.h>
 #include <linux/param.h>
 
 typedef	void	*(*fpi_t)(void);
@@ -26,6 +31,20 @@ typedef struct	tdesc
 	fpd_t	done;
 } tdesc_t;
 
+/*
+ * Latencies are kept in a log-linear histogram: 8 buckets per power of two
+ * of nanoseconds, which is within 12.5% of the real value.
+ */
+#define	LAT_BUCKETS	512
+
+typedef struct	wresult
+{
+	double		start;
+	double		end;
+	uint64_t	ops;
+	uint64_t	hist[LAT_BUCKETS];
+} wresult_t;
+
 static void	d_readdir(void *);
 static void	*i_readdir(void);
 static void	t_readdir(int, void *);
@@ -56,6 +75,14 @@ static void	t_open(int, void *);
 static void	t_rename(int, void *);
 static void	t_stat(int, void *);
 static void	usage(void);
+static void	lat_begin(void);
+static void	lat_end(void);
+static int	lat_bucket(uint64_t);
+static double	lat_usec(int);
+static double	lat_percentile(uint64_t *, double);
+static void	scaletest(tdesc_t *);
+static void	runscale(tdesc_t *, int, int);
+static void	worker(tdesc_t *, int, int, int, int, int, wresult_t *);
 
 tdesc_t	tests[] = {
 	{ "chown",	i_chown, t_chown, d_chown },
@@ -83,6 +110,13 @@ double		time_end;
 double		time_start;
 int		totsec = 0;
 int		verbose = 0;
+int		maxthreads = 0;
+int		placement = 3;		/* bit 0 private, bit 1 shared */
+char		fnprefix[16] = "";
+char		linkname[24] = "a";
+int		lat_record = 0;
+uint64_t	lat_hist[LAT_BUCKETS];
+uint64_t	lat_t0;
 
 int
 main(int argc, char **argv)
@@ -94,7 +128,7 @@ main(int argc, char **argv)
 	testdir = getenv("TMPDIR");
 	if (testdir == NULL)
 		testdir = ".";
-	while ((c = getopt(argc, argv, "cd:i:l:L:n:N:s:t:v")) != -1) {
+	while ((c = getopt(argc, argv, "cd:i:l:L:n:N:P:s:t:T:v")) != -1) {
 		switch (c) {
 		case 'c':
 			compact = 1;
@@ -117,12 +151,27 @@ main(int argc, char **argv)
 		case 'N':
 			files_bg = atoi(optarg);
 			break;
+		case 'P':
+			if (strcmp(optarg, "private") == 0)
+				placement = 1;
+			else if (strcmp(optarg, "shared") == 0)
+				placement = 2;
+			else if (strcmp(optarg, "both") == 0)
+				placement = 3;
+			else
+				usage();
+			break;
 		case 's':
 			fsize = atoi(optarg);
 			break;
 		case 't':
 			totsec = atoi(optarg);
 			break;
+		case 'T':
+			maxthreads = atoi(optarg);
+			if (maxthreads < 1)
+				usage();
+			break;
 		case 'v':
 			verbose = 1;
 			break;
@@ -131,6 +180,11 @@ main(int argc, char **argv)
 			usage();
 		}
 	}
+	if (maxthreads && totsec) {
+		fprintf(stderr, "-T runs a fixed number of iterations, "
+			"use -i instead of -t\n");
+		usage();
+	}
 	if (!iters && !totsec)
 		iters = 1;
 	if (chdir(testdir) < 0) {
@@ -144,7 +198,10 @@ main(int argc, char **argv)
 	for (; optind < argc; optind++) {
 		for (tp = tests; tp->name; tp++) {
 			if (strcmp(argv[optind], tp->name) == 0) {
-				dotest(tp);
+				if (maxthreads)
+					scaletest(tp);
+				else
+					dotest(tp);
 				break;
 			}
 		}
@@ -161,10 +218,12 @@ crfiles(char **flist, int fsize, char *buf)
 	char	**fnp;
 
 	for (fnp = flist; *fnp; fnp++) {
+		lat_begin();
 		fd = creat(*fnp, 0666);
 		if (fsize)
 			write(fd, buf, fsize);
 		close(fd);
+		lat_end();
 	}
 }
 
@@ -193,7 +252,7 @@ d_readdir(void *v)
 static void
 d_linkun(void *v)
 {
-	unlink("a");
+	unlink(linkname);
 }
 
 /* ARGSUSED */
@@ -309,7 +368,7 @@ i_readdir(void)
 static void *
 i_linkun(void)
 {
-	close(creat("a", 0666));
+	close(creat(linkname, 0666));
 	return (void *)0;
 }
 
@@ -342,8 +401,8 @@ mkflist(int files, int fnlen, char start)
 
 	rval = calloc(files + 1, sizeof(char *));
 	for (i = 0; i < files; i++) {
-		rval[i] = malloc(fnlen + 1);
-		sprintf(rval[i], "%0*d%c", fnlen - 1, i, start);
+		rval[i] = malloc(strlen(fnprefix) + fnlen + 1);
+		sprintf(rval[i], "%s%0*d%c", fnprefix, fnlen - 1, i, start);
 	}
 	return rval;
 }
@@ -387,8 +446,11 @@ rmfiles(char **flist)
 {
 	char	**fnp;
 
-	for (fnp = flist; *fnp; fnp++)
+	for (fnp = flist; *fnp; fnp++) {
+		lat_begin();
 		unlink(*fnp);
+		lat_end();
+	}
 }
 
 /* ARGSUSED */
@@ -400,10 +462,12 @@ t_chown(int n, void *v)
 
 	for (i = 0; i < n; i++) {
 		for (fnp = flist_op; *fnp; fnp++) {
+			lat_begin();
 			if ((i & 1) == 0)
 				chown(*fnp, 2, -1);
 			else
 				chown(*fnp, 1, -1);
+			lat_end();
 		}
 	}
 }
@@ -437,8 +501,10 @@ t_readdir(int n, void *v)
 	int	i;
 
 	for (dir = (DIR *)v, i = 0; i < n; i++) {
+		lat_begin();
 		rewinddir(dir);
 		while ((readdir(dir)) != NULL);
+		lat_end();
 	}
 }
 
@@ -450,8 +516,11 @@ t_linkun(int n, void *v)
 	int	i;
 
 	for (i = 0; i < n; i++) {
-		for (fnp = flist_op; *fnp; fnp++)
-			link("a", *fnp);
+		for (fnp = flist_op; *fnp; fnp++) {
+			lat_begin();
+			link(linkname, *fnp);
+			lat_end();
+		}
 		rmfiles(flist_op);
 	}
 }
@@ -464,8 +533,11 @@ t_open(int n, void *v)
 	int		i;
 
 	for (i = 0; i < n; i++) {
-		for (fnp = flist_op; *fnp; fnp++)
+		for (fnp = flist_op; *fnp; fnp++) {
+			lat_begin();
 			close(open(*fnp, O_RDWR));
+			lat_end();
+		}
 	}
 }
 
@@ -479,10 +551,12 @@ t_rename(int n, void *v)
 
 	for (rflist = (char **)v, i = 0; i < n; i++) {
 		for (fnp = flist_op, rfp = rflist; *fnp; fnp++, rfp++) {
+			lat_begin();
 			if ((i & 1) == 0)
 				rename(*fnp, *rfp);
 			else
 				rename(*rfp, *fnp);
+			lat_end();
 		}
 	}
 }
@@ -496,8 +570,11 @@ t_stat(int n, void *v)
 	struct stat	stb;
 
 	for (i = 0; i < n; i++) {
-		for (fnp = flist_op; *fnp; fnp++)
+		for (fnp = flist_op; *fnp; fnp++) {
+			lat_begin();
 			stat(*fnp, &stb);
+			lat_end();
+		}
 	}
 }
 
@@ -507,8 +584,270 @@ usage(void)
 	fprintf(stderr,
 		"Usage: metaperf [-d dname] [-i iters|-t seconds] [-s fsize]\n"
 		"\t[-l opfnamelen] [-L bgfnamelen]\n"
-		"\t[-n opfcount] [-N bgfcount] test...\n");
+		"\t[-n opfcount] [-N bgfcount]\n"
+		"\t[-T maxthreads [-P private|shared|both]] test...\n");
 	fprintf(stderr,
 		"Tests: chown create crunlink linkun open rename stat readdir\n");
+	fprintf(stderr,
+		"-T runs each test from 1 up to maxthreads processes at once,\n"
+		"each in a directory of its own and/or all in one shared\n"
+		"directory, and prints ops/sec and latency percentiles.\n"
+		"An op is one timed call: crunlink and linkun count the\n"
+		"create or link and the unlink separately, readdir counts\n"
+		"scans of the whole directory.\n");
 	exit(1);
 }
+
+static uint64_t
+nsnow(void)
+{
+	struct timespec	t;
+
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return (uint64_t)t.tv_sec * 1000000000ULL + t.tv_nsec;
+}
+
+static void
+lat_begin(void)
+{
+	if (lat_record)
+		lat_t0 = nsnow();
+}
+
+static void
+lat_end(void)
+{
+	if (lat_record)
+		lat_hist[lat_bucket(nsnow() - lat_t0)]++;
+}
+
+static int
+lat_bucket(uint64_t ns)
+{
+	int	e;
+
+	if (ns < 8)
+		return (int)ns;
+	e = 63 - __builtin_clzll(ns);
+	return (e - 2) * 8 + (int)((ns >> (e - 3)) & 7);
+}
+
+/* middle of a bucket in usec */
+static double
+lat_usec(int b)
+{
+	double	width;
+	int	e;
+
+	if (b < 8)
+		return b / 1000.0;
+	e = b / 8 + 2;
+	width = (double)(1ULL << (e - 3));
+	return ((8 + b % 8) * width + width / 2) / 1000.0;
+}
+
+static double
+lat_percentile(uint64_t *hist, double pct)
+{
+	uint64_t	total = 0;
+	uint64_t	sum = 0;
+	int		b;
+
+	for (b = 0; b < LAT_BUCKETS; b++)
+		total += hist[b];
+	if (!total)
+		return 0;
+	for (b = 0; b < LAT_BUCKETS; b++) {
+		sum += hist[b];
+		if (sum >= total * pct / 100.0)
+			break;
+	}
+	return lat_usec(b);
+}
+
+static void
+scaletest(tdesc_t *tp)
+{
+	int	shared;
+	int	nthreads;
+
+	for (shared = 0; shared < 2; shared++) {
+		if (!(placement & (1 << shared)))
+			continue;
+		if (!compact)
+			printf("%s: %d times, %d file(s) namelen %d, "
+				"%s directory\n"
+				"%8s %14s %10s %10s %10s %10s %10s\n",
+				tp->name, iters, files_op, fnlen_op,
+				shared ? "shared" : "private",
+				"threads", "ops/sec", "p50 usec", "p90 usec",
+				"p99 usec", "p99.9 usec", "max usec");
+		for (nthreads = 1; ; nthreads *= 2) {
+			if (nthreads > maxthreads)
+				nthreads = maxthreads;
+			runscale(tp, nthreads, shared);
+			if (nthreads == maxthreads)
+				break;
+		}
+	}
+}
+
+/*
+ * Run tp in nthreads worker processes at once.  All workers set up their
+ * files first, then start together, the rate is taken from the first start
+ * to the last finish.
+ */
+static void
+runscale(tdesc_t *tp, int nthreads, int shared)
+{
+	wresult_t	*res;
+	uint64_t	hist[LAT_BUCKETS];
+	uint64_t	ops = 0;
+	double		start = 0;
+	double		end = 0;
+	double		ops_per_sec;
+	pid_t		*pids;
+	int		ready[2];
+	int		go[2];
+	int		failed = 0;
+	int		status;
+	int		i;
+	int		b;
+	char		c;
+
+	res = mmap(NULL, nthreads * sizeof(*res), PROT_READ | PROT_WRITE,
+		   MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	pids = calloc(nthreads, sizeof(*pids));
+	if (res == MAP_FAILED || !pids || pipe(ready) < 0 || pipe(go) < 0) {
+		perror("metaperf");
+		exit(1);
+	}
+	if (shared)
+		mkdir("shared", 0777);
+	for (i = 0; i < nthreads; i++) {
+		switch (pids[i] = fork()) {
+		case -1:
+			perror("fork");
+			failed = 1;
+			break;
+		case 0:
+			close(ready[0]);
+			close(go[1]);
+			worker(tp, i, shared, ready[1], go[0],
+				iters ? iters : 1, &res[i]);
+			_exit(0);
+		}
+		if (failed)
+			break;
+	}
+	close(ready[1]);
+	close(go[0]);
+	/* every worker closes ready once it got there, or by dying */
+	for (i = 0; i < nthreads && !failed; i++) {
+		if (read(ready[0], &c, 1) != 1)
+			failed = 1;
+	}
+	if (failed) {
+		for (i = 0; i < nthreads && pids[i] > 0; i++)
+			kill(pids[i], SIGKILL);
+	} else {
+		sync();
+		sleep(1);
+	}
+	close(go[1]);
+	for (i = 0; i < nthreads && pids[i] > 0; i++) {
+		if (waitpid(pids[i], &status, 0) < 0 ||
+		    !WIFEXITED(status) || WEXITSTATUS(status))
+			failed = 1;
+	}
+	close(ready[0]);
+	free(pids);
+	if (shared)
+		rmdir("shared");
+	if (failed) {
+		fprintf(stderr, "metaperf: worker failed\n");
+		exit(1);
+	}
+
+	memset(hist, 0, sizeof(hist));
+	for (i = 0; i < nthreads; i++) {
+		if (!i || res[i].start < start)
+			start = res[i].start;
+		if (!i || res[i].end > end)
+			end = res[i].end;
+		ops += res[i].ops;
+		for (b = 0; b < LAT_BUCKETS; b++)
+			hist[b] += res[i].hist[b];
+	}
+	for (b = LAT_BUCKETS - 1; b > 0 && !hist[b]; b--)
+		;
+	ops_per_sec = end > start ? ops / (end - start) : 0;
+	if (compact)
+		printf("%s %s %d %d %d %d %d %d %d %f %f %f %f %f %f %f\n",
+			tp->name, shared ? "shared" : "private", nthreads,
+			iters, files_op, fnlen_op, fsize, files_bg, fnlen_bg,
+			end - start, ops_per_sec,
+			lat_percentile(hist, 50), lat_percentile(hist, 90),
+			lat_percentile(hist, 99), lat_percentile(hist, 99.9),
+			lat_usec(b));
+	else
+		printf("%8d %14.1f %10.2f %10.2f %10.2f %10.2f %10.2f\n",
+			nthreads, ops_per_sec,
+			lat_percentile(hist, 50), lat_percentile(hist, 90),
+			lat_percentile(hist, 99), lat_percentile(hist, 99.9),
+			lat_usec(b));
+	fflush(stdout);
+	munmap(res, nthreads * sizeof(*res));
+}
+
+static void
+worker(tdesc_t *tp, int id, int shared, int ready, int go, int n,
+	wresult_t *res)
+{
+	char	dname[16];
+	void	*v = NULL;
+	char	c;
+	int	i;
+
+	if (shared) {
+		strcpy(dname, "shared");
+	} else {
+		sprintf(dname, "w%d", id);
+		mkdir(dname, 0777);
+	}
+	if (chdir(dname) < 0) {
+		perror(dname);
+		_exit(1);
+	}
+	/* names must not collide with the other workers in a shared dir */
+	sprintf(fnprefix, "%d_", id);
+	sprintf(linkname, "%d_a", id);
+	flist_bg = mkflist(files_bg, fnlen_bg, 'b');
+	flist_op = mkflist(files_op, fnlen_op, 'o');
+	buffer = fsize ? calloc(fsize, 1) : NULL;
+	crfiles(flist_bg, 0, (char *)0);
+	if (tp->init)
+		v = (tp->init)();
+
+	write(ready, "r", 1);
+	/* so the parent sees EOF if a worker dies before it gets here */
+	close(ready);
+	read(go, &c, 1);
+
+	lat_record = 1;
+	res->start = now();
+	(tp->test)(n, v);
+	res->end = now();
+	lat_record = 0;
+	/* ops/sec and the percentiles are both per timed call */
+	res->ops = 0;
+	for (i = 0; i < LAT_BUCKETS; i++)
+		res->ops += lat_hist[i];
+	memcpy(res->hist, lat_hist, sizeof(lat_hist));
+
+	if (tp->done)
+		(tp->done)(v);
+	rmfiles(flist_bg);
+	if (chdir("..") == 0 && !shared)
+		rmdir(dname);
+}
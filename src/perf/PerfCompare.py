@@ -0,0 +1,68 @@
+# SPDX-License-Identifier: GPL-2.0
+
+import PerfStats
+
+def _change(old, new):
+    if old == 0:
+        return 0
+    return (new - old) / abs(old) * 100
+
+def _compare_mwu(old, new, better, alpha):
+    '''Compare the medians, significant if the U test says so'''
+    change = _change(PerfStats.median(old), PerfStats.median(new))
+    p = PerfStats.mann_whitney(old, new)
+    return change, p < alpha, "p={:.3f}".format(p)
+
+def _compare_ci(old, new, better, alpha):
+    '''Compare the means, significant if the interval of their difference
+    doesn't include zero'''
+    m = PerfStats.mean(old)
+    change = _change(m, PerfStats.mean(new))
+    lo, hi = PerfStats.welch_interval(old, new, alpha)
+    ci = "{:.0f}% ci [{:+.1f}%, {:+.1f}%]".format((1 - alpha) * 100,
+                                                _change(m, m + lo),
+                                                _change(m, m + hi))
+    return change, lo > 0 or hi < 0, ci
+
+methods = { 'mwu': _compare_mwu, 'ci': _compare_ci }
+
+def compare_samples(history, samples, method='mwu', alpha=0.05, threshold=0,
+                    failures_only=True):
+    '''Compare the samples of a run against the samples of earlier runs
+
+    Both are dicts mapping metric names to (better, [values]), better being
+    'higher' or 'lower'.  A metric regressed if the difference is
+    statistically significant, goes the wrong way and is larger than
+    threshold percent.  A single noisy run can't do that, so metrics need
+    at least two samples on both sides to be compared at all.
+
+    Benchmarks report several metrics per run, so alpha is split between
+    them (Bonferroni) to keep the chance of a false alarm per run at alpha.
+    '''
+    failed = 0
+    metrics = []
+    for metric in sorted(samples.keys()):
+        if metric not in history:
+            continue
+        if len(history[metric][1]) < 2 or len(samples[metric][1]) < 2:
+            if not failures_only:
+                print("{} has too few samples to compare".format(metric))
+            continue
+        metrics.append(metric)
+    for metric in metrics:
+        better, new = samples[metric]
+        old = history[metric][1]
+        change, significant, detail = methods[method](old, new, better,
+                                                      alpha / len(metrics))
+        worse = change < 0 if better == 'higher' else change > 0
+        if not significant or abs(change) <= threshold:
+            if not failures_only:
+                print("{} is a-ok {:+.1f}% {}".format(metric, change, detail))
+        elif worse:
+            print("    {} regressed: {:+.1f}% {}".format(metric, change,
+                                                        detail))
+            failed += 1
+        elif not failures_only:
+            print("    {} improved: {:+.1f}% {}".format(metric, change,
+                                                       detail))
+    return failed
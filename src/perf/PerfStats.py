@@ -0,0 +1,116 @@
+# SPDX-License-Identifier: GPL-2.0
+
+import math
+
+def mean(values):
+    return float(sum(values)) / len(values)
+
+def variance(values):
+    m = mean(values)
+    return sum((v - m) ** 2 for v in values) / (len(values) - 1)
+
+def median(values):
+    s = sorted(values)
+    n = len(s)
+    if n % 2:
+        return float(s[n // 2])
+    return (s[n // 2 - 1] + s[n // 2]) / 2.0
+
+def _norm_cdf(x):
+    return 0.5 * (1 + math.erf(x / math.sqrt(2)))
+
+def _norm_ppf(p):
+    '''Inverse of the standard normal CDF, by bisection'''
+    lo, hi = -40.0, 40.0
+    for i in range(100):
+        mid = (lo + hi) / 2
+        if _norm_cdf(mid) < p:
+            lo = mid
+        else:
+            hi = mid
+    return (lo + hi) / 2
+
+def _t_ppf(p, df):
+    '''Inverse of the Student t CDF
+
+    Uses the Cornish-Fisher expansion around the normal quantile, which is
+    good to a couple of percent from 3 degrees of freedom on.  That's plenty
+    for deciding whether a benchmark moved.
+    '''
+    z = _norm_ppf(p)
+    g1 = (z ** 3 + z) / 4
+    g2 = (5 * z ** 5 + 16 * z ** 3 + 3 * z) / 96
+    g3 = (3 * z ** 7 + 19 * z ** 5 + 17 * z ** 3 - 15 * z) / 384
+    return z + g1 / df + g2 / df ** 2 + g3 / df ** 3
+
+def welch_interval(old, new, alpha):
+    '''Confidence interval of mean(new) - mean(old) at level 1 - alpha'''
+    va = variance(old) / len(old)
+    vb = variance(new) / len(new)
+    diff = mean(new) - mean(old)
+    if va + vb == 0:
+        return (diff, diff)
+    df = (va + vb) ** 2 / (va ** 2 / (len(old) - 1) + vb ** 2 / (len(new) - 1))
+    half = _t_ppf(1 - alpha / 2, df) * math.sqrt(va + vb)
+    return (diff - half, diff + half)
+
+def _ranks(values):
+    '''Ranks of values starting at 1, ties get the average of their ranks'''
+    order = sorted(range(len(values)), key=lambda i: values[i])
+    ranks = [0.0] * len(values)
+    ties = []
+    i = 0
+    while i < len(order):
+        j = i
+        while j + 1 < len(order) and values[order[j + 1]] == values[order[i]]:
+            j += 1
+        for k in range(i, j + 1):
+            ranks[order[k]] = (i + j) / 2.0 + 1
+        ties.append(j - i + 1)
+        i = j + 1
+    return ranks, ties
+
+def _u_exact(n1, n2):
+    '''Number of orderings of n1 + n2 samples giving each value of U'''
+    # f[m][n][u] = f[m - 1][n][u - n] + f[m][n - 1][u]
+    prev = [[1] + [0] * (n1 * n2) for n in range(n2 + 1)]
+    for m in range(1, n1 + 1):
+        cur = [[1] + [0] * (n1 * n2)]
+        for n in range(1, n2 + 1):
+            row = [0] * (n1 * n2 + 1)
+            for u in range(m * n + 1):
+                c = cur[n - 1][u]
+                if u >= n:
+                    c += prev[n][u - n]
+                row[u] = c
+            cur.append(row)
+        prev = cur
+    return prev[n2][:n1 * n2 + 1]
+
+def mann_whitney(old, new):
+    '''Two sided p-value of the Mann-Whitney U test of old against new
+
+    Small samples without ties get the exact distribution of U, everything
+    else the normal approximation with tie and continuity correction.
+    '''
+    n1 = len(old)
+    n2 = len(new)
+    ranks, ties = _ranks(list(old) + list(new))
+    u = sum(ranks[:n1]) - n1 * (n1 + 1) / 2.0
+    mu = n1 * n2 / 2.0
+
+    if max(ties) == 1 and n1 + n2 <= 40:
+        counts = _u_exact(n1, n2)
+        total = float(sum(counts))
+        u = int(u)
+        lower = sum(counts[:u + 1]) / total
+        upper = sum(counts[u:]) / total
+        return min(1.0, 2 * min(lower, upper))
+
+    n = n1 + n2
+    tie_term = sum(t ** 3 - t for t in ties) / float(n * (n - 1))
+    sigma = math.sqrt(n1 * n2 / 12.0 * ((n + 1) - tie_term))
+    if sigma == 0:
+        return 1.0
+    z = (abs(u - mu) - 0.5) / sigma
+    return min(1.0, 2 * (1 - _norm_cdf(max(z, 0))))
@@ -43,3 +43,26 @@ class ResultData:
         for job in result['jobs']:
             job['run_id'] = row_id
             self._insert_obj('fio_jobs', job)
+
+    def load_samples(self, testname, config, runs):
+        '''Samples of the last runs of a test, by metric'''
+        samples = {}
+        cur = self.db.cursor()
+        cur.execute("SELECT id FROM perf_runs WHERE config = ? AND name = ? ORDER BY id DESC LIMIT ?",
+                    (config, testname, runs))
+        for run in cur.fetchall():
+            cur.execute("SELECT metric, better, value FROM perf_samples WHERE run_id = ?",
+                        (run['id'],))
+            for row in cur.fetchall():
+                samples.setdefault(row['metric'], (row['better'], []))
+                samples[row['metric']][1].append(row['value'])
+        return samples
+
+    def insert_samples(self, run, samples):
+        run_id = self._insert_obj('perf_runs', run)
+        for metric, (better, values) in samples.items():
+            for value in values:
+                self._insert_obj('perf_samples', { 'run_id': run_id,
+                                                   'metric': metric,
+                                                   'better': better,
+                                                   'value': value })
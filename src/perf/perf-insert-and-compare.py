@@ -0,0 +1,65 @@
+# SPDX-License-Identifier: GPL-2.0
+#
+# Store the results of a benchmark run and compare them against the runs of
+# the same test and config before it.  The result file has one sample per
+# line:
+#
+#   <metric> <higher|lower> <value>
+#
+# where the second field says which way is better for the metric.  A
+# benchmark that repeats its measurement lists each metric once per
+# repetition.
+
+import ResultData
+import PerfCompare
+import argparse
+import datetime
+import sys
+import platform
+
+parser = argparse.ArgumentParser()
+parser.add_argument('-c', '--configname', type=str,
+                    help="The config name to save the results under.",
+                    required=True)
+parser.add_argument('-d', '--db', type=str,
+                    help="The db that is being used", required=True)
+parser.add_argument('-n', '--testname', type=str,
+                    help="The testname for the result", required=True)
+parser.add_argument('-m', '--method', type=str, default='mwu',
+                    choices=sorted(PerfCompare.methods.keys()),
+                    help="Mann-Whitney U test or confidence interval.")
+parser.add_argument('-a', '--alpha', type=float, default=0.05,
+                    help="Significance level of the comparison.")
+parser.add_argument('-H', '--history', type=int, default=5,
+                    help="Number of earlier runs to compare against.")
+parser.add_argument('-t', '--threshold', type=float, default=0,
+                    help="Ignore changes smaller than this many percent.")
+parser.add_argument('-v', '--verbose', action='store_true',
+                    help="Also print the metrics that didn't regress.")
+parser.add_argument('result', type=str,
+                    help="The result file to compare and insert")
+args = parser.parse_args()
+
+samples = {}
+for line in open(args.result):
+    fields = line.split()
+    if len(fields) != 3 or fields[1] not in ('higher', 'lower'):
+        sys.stderr.write("bad result line: {}".format(line))
+        sys.exit(2)
+    samples.setdefault(fields[0], (fields[1], []))
+    samples[fields[0]][1].append(float(fields[2]))
+
+result_data = ResultData.ResultData(args.db)
+history = result_data.load_samples(args.testname, args.configname,
+                                   args.history)
+
+run = {}
+run['name'] = args.testname
+run['config'] = args.configname
+run['kernel'] = platform.release()
+run['time'] = datetime.datetime.now().isoformat()
+result_data.insert_samples(run, samples)
+
+if PerfCompare.compare_samples(history, samples, args.method, args.alpha,
+                               args.threshold, not args.verbose):
+    sys.exit(1)
@@ -0,0 +1,16 @@
+CREATE TABLE IF NOT EXISTS `perf_runs` (
+  `id` INTEGER PRIMARY KEY AUTOINCREMENT,
+  `kernel` varchar(256) NOT NULL,
+  `config` varchar(256) NOT NULL,
+  `name` varchar(256) NOT NULL,
+  `time` datetime NOT NULL
+);
+CREATE TABLE IF NOT EXISTS `perf_samples` (
+  `id` INTEGER PRIMARY KEY AUTOINCREMENT,
+  `run_id` int NOT NULL,
+  `metric` varchar(256) NOT NULL,
+  `better` varchar(8) NOT NULL,
+  `value` float NOT NULL
+);
+CREATE INDEX IF NOT EXISTS `perf_runs_name` ON `perf_runs` (`config`, `name`);
+CREATE INDEX IF NOT EXISTS `perf_samples_run` ON `perf_samples` (`run_id`);
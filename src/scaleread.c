@@ -13,9 +13,11 @@
  *	- each processes opens , read, closes each file
  *	- option to resync each process at each file
  *
- *	test [-c cpus] [-b bytes] [-f files] [-v] [-s] [-S]
+ *	test [-c cpus] [-b bytes] [-d dir] [-f files] [-v] [-s] [-S]
  *			OR
- *	test -i [-b bytes] [-f files] 
+ *	test -i [-b bytes] [-d dir] [-f files] 
+ *
+ *	The files live in dir, /tmp by default.
  */
 #include <unistd.h>
 #include <string.h>
@@ -25,6 +27,7 @@
 #include <sys/stat.h>
 #include <sys/wait.h>
 #include <fcntl.h>
+#include <limits.h>
 #include <stdlib.h>
 #include <sys/ipc.h>
 #include <sys/shm.h>
@@ -43,6 +46,7 @@ int files=1;
 int blksize=512;
 int syncstep=0;
 int verbose=0;
+char *dir="/tmp";
 
 typedef struct {
         volatile long   go;
@@ -92,7 +96,7 @@ scaled_atol(char *p)
 int
 main(int argc, char** argv) {
         int shmid;
-        static  char            optstr[] = "c:b:f:sSivH";
+        static  char            optstr[] = "c:b:d:f:sSivH";
         int                     notdone, stat, i, j, c, er=0;
 
         opterr=1;
@@ -104,6 +108,9 @@ main(int argc, char** argv) {
                 case 'b':
                         bytes = scaled_atol(optarg);
                         break;
+                case 'd':
+                        dir = optarg;
+                        break;
                 case 'f':
                         files = atoi(optarg);
                         break;
@@ -173,7 +180,7 @@ void
 slave(int id)
 {
 	int	i, fd, byte;
-	char	*buf, filename[32];
+	char	*buf, filename[PATH_MAX];
 
 	runon (id+1);
 	buf = malloc(blksize);
@@ -183,7 +190,7 @@ slave(int id)
 			sharep->rdy[id] = i;
 			while(sharep->go != i);
 		}
-		sprintf(filename, "/tmp/tst.%d", (strided ? ((i + id) % files) : i));
+		sprintf(filename, "%s/tst.%d", dir, (strided ? ((i + id) % files) : i));
 		if ((fd = open (filename, O_RDONLY)) < 0) {
 			perrorx(filename);
 		}
@@ -201,13 +208,13 @@ void
 do_initfiles(void)
 {
 	int	i, fd, byte;
-	char	*buf, filename[32];
+	char	*buf, filename[PATH_MAX];
 
 	buf = malloc(blksize);
 	bzero(buf, blksize);
 
 	for (i=0; i<files; i++) {
-		sprintf(filename, "/tmp/tst.%d", i);
+		sprintf(filename, "%s/tst.%d", dir, i);
 		unlink(filename);
 		if ((fd = open (filename, O_RDWR|O_CREAT, 0644)) < 0)
 			perrorx(filename);
@@ -0,0 +1,156 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Streaming XXH64, see xxhash.h.
+ *
+ * Input is consumed in 32 byte stripes by four independent accumulators,
+ * which is what makes this an order of magnitude faster than MD5 for file
+ * data.  Whatever is left over on Final is mixed in 8, 4 and 1 byte steps.
+ */
+#include <string.h>
+#include <endian.h>
+
+#include "xxhash.h"
+
+#define PRIME64_1 0x9E3779B185EBCA87ULL
+#define PRIME64_2 0xC2B2AE3D27D4EB4FULL
+#define PRIME64_3 0x165667B19E3779F9ULL
+#define PRIME64_4 0x85EBCA77C2B2AE63ULL
+#define PRIME64_5 0x27D4EB2F165667C5ULL
+
+static inline uint64_t rotl64(uint64_t x, int r)
+{
+	return (x << r) | (x >> (64 - r));
+}
+
+static inline uint64_t read64(const unsigned char *p)
+{
+	uint64_t v;
+
+	memcpy(&v, p, sizeof(v));
+	return le64toh(v);
+}
+
+static inline uint32_t read32(const unsigned char *p)
+{
+	uint32_t v;
+
+	memcpy(&v, p, sizeof(v));
+	return le32toh(v);
+}
+
+static inline uint64_t xxh64_round(uint64_t acc, uint64_t input)
+{
+	acc += input * PRIME64_2;
+	acc = rotl64(acc, 31);
+	return acc * PRIME64_1;
+}
+
+static inline uint64_t xxh64_merge_round(uint64_t acc, uint64_t val)
+{
+	acc ^= xxh64_round(0, val);
+	return acc * PRIME64_1 + PRIME64_4;
+}
+
+static const unsigned char *xxh64_stripes(XXH64_CTX *ctx,
+					  const unsigned char *p,
+					  const unsigned char *end)
+{
+	uint64_t v1 = ctx->v[0];
+	uint64_t v2 = ctx->v[1];
+	uint64_t v3 = ctx->v[2];
+	uint64_t v4 = ctx->v[3];
+
+	while (p + 32 <= end) {
+		v1 = xxh64_round(v1, read64(p));
+		v2 = xxh64_round(v2, read64(p + 8));
+		v3 = xxh64_round(v3, read64(p + 16));
+		v4 = xxh64_round(v4, read64(p + 24));
+		p += 32;
+	}
+	ctx->v[0] = v1;
+	ctx->v[1] = v2;
+	ctx->v[2] = v3;
+	ctx->v[3] = v4;
+	return p;
+}
+
+void XXH64_Init(XXH64_CTX *ctx, uint64_t seed)
+{
+	memset(ctx, 0, sizeof(*ctx));
+	ctx->seed = seed;
+	ctx->v[0] = seed + PRIME64_1 + PRIME64_2;
+	ctx->v[1] = seed + PRIME64_2;
+	ctx->v[2] = seed;
+	ctx->v[3] = seed - PRIME64_1;
+}
+
+void XXH64_Update(XXH64_CTX *ctx, const void *data, unsigned long size)
+{
+	const unsigned char *p = data;
+	const unsigned char *end = p + size;
+
+	ctx->total_len += size;
+
+	if (ctx->memsize + size < 32) {
+		memcpy(ctx->mem + ctx->memsize, p, size);
+		ctx->memsize += size;
+		return;
+	}
+
+	if (ctx->memsize) {
+		unsigned int fill = 32 - ctx->memsize;
+
+		memcpy(ctx->mem + ctx->memsize, p, fill);
+		xxh64_stripes(ctx, ctx->mem, ctx->mem + 32);
+		p += fill;
+		ctx->memsize = 0;
+	}
+
+	p = xxh64_stripes(ctx, p, end);
+	if (p < end) {
+		memcpy(ctx->mem, p, end - p);
+		ctx->memsize = end - p;
+	}
+}
+
+uint64_t XXH64_Final(XXH64_CTX *ctx)
+{
+	const unsigned char *p = ctx->mem;
+	const unsigned char *end = p + ctx->memsize;
+	uint64_t h;
+
+	if (ctx->total_len >= 32) {
+		h = rotl64(ctx->v[0], 1) + rotl64(ctx->v[1], 7) +
+		    rotl64(ctx->v[2], 12) + rotl64(ctx->v[3], 18);
+		h = xxh64_merge_round(h, ctx->v[0]);
+		h = xxh64_merge_round(h, ctx->v[1]);
+		h = xxh64_merge_round(h, ctx->v[2]);
+		h = xxh64_merge_round(h, ctx->v[3]);
+	} else {
+		h = ctx->seed + PRIME64_5;
+	}
+	h += ctx->total_len;
+
+	while (p + 8 <= end) {
+		h ^= xxh64_round(0, read64(p));
+		h = rotl64(h, 27) * PRIME64_1 + PRIME64_4;
+		p += 8;
+	}
+	if (p + 4 <= end) {
+		h ^= (uint64_t)read32(p) * PRIME64_1;
+		h = rotl64(h, 23) * PRIME64_2 + PRIME64_3;
+		p += 4;
+	}
+	while (p < end) {
+		h ^= (*p) * PRIME64_5;
+		h = rotl64(h, 11) * PRIME64_1;
+		p++;
+	}
+
+	h ^= h >> 33;
+	h *= PRIME64_2;
+	h ^= h >> 29;
+	h *= PRIME64_3;
+	h ^= h >> 32;
+	return h;
+}
@@ -0,0 +1,24 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Streaming XXH64, a fast non-cryptographic hash.  This implements the
+ * algorithm as specified by Yann Collet's xxHash, version 0.8, and produces
+ * the same digests as XXH64() from the reference library.
+ */
+#ifndef _XXHASH_H
+#define _XXHASH_H
+
+#include <stdint.h>
+
+typedef struct {
+	uint64_t total_len;
+	uint64_t v[4];
+	unsigned char mem[32];
+	unsigned int memsize;
+	uint64_t seed;
+} XXH64_CTX;
+
+extern void XXH64_Init(XXH64_CTX *ctx, uint64_t seed);
+extern void XXH64_Update(XXH64_CTX *ctx, const void *data, unsigned long size);
+extern uint64_t XXH64_Final(XXH64_CTX *ctx);
+
+#endif